@@ -5,6 +5,13 @@
 #undef TFS_EXTENDED_API
 #undef TFS_READ_DIR_USERDATA
 
+#define TFS_MMC_DEFER_BUSY
+
+#define TFS_DRIVE_MULTI_BLOCK
+#define TFS_MULTI_BLOCK_MAX 8
+
+#define TFS_DRIVE_STREAM
+
 #define spi_send_byte(b) spi_transfer_byte(b)
 #define spi_rec_byte() spi_transfer_byte(0xff)
 uint8_t spi_transfer_byte(uint8_t b);
@@ -79,7 +79,7 @@ uint8_t tfs_dir_handler(const TFS_DIR_ITEM *item) {
   uint8_t b;
   const char *c;
 
-  switch (item->type) {
+  switch (TFS_DIR_ITEM_TYPE(item->type)) {
     case TFS_DIR_ITEM_DIR:
       dirs++;
       uart_puts_p(PSTR("     <DIR>"));
@@ -14,6 +14,24 @@ typedef struct {
 
 #define TFS_DATA_LEN (TFS_BLOCKSIZE - sizeof(TFS_DATA_BLK))
 
+// number of data blocks holding 'size' bytes
+#define TFS_DATA_BLOCKS(size) (((size) + TFS_DATA_LEN - 1) / TFS_DATA_LEN)
+
+#ifdef TFS_DRIVE_MULTI_BLOCK
+#ifndef TFS_MULTI_BLOCK_MAX
+#define TFS_MULTI_BLOCK_MAX 16
+#endif
+
+typedef struct {
+  uint32_t prev;
+  uint32_t next;
+} _PACKED TFS_DATA_HDR;
+#endif
+
+#if defined(TFS_DRIVE_STREAM) && (defined(TFS_CACHE_BLOCKS) || defined(TFS_DRIVE_MAP_BLOCK))
+#error "TFS_DRIVE_STREAM can not be combined with TFS_CACHE_BLOCKS or TFS_DRIVE_MAP_BLOCK"
+#endif
+
 typedef struct {
   uint32_t prev;
   uint32_t next;
@@ -23,10 +41,95 @@ typedef struct {
 
 #define TFS_DIR_BLK_ITEMS ((TFS_BLOCKSIZE - sizeof(TFS_DIR_BLK)) / sizeof(TFS_DIR_ITEM))
 
+#ifdef TFS_EXTENT_FILES
+// run of consecutive data blocks of an extent file
+typedef struct {
+  uint32_t start;
+  uint32_t len;
+} _PACKED TFS_FILE_EXT;
+
+// map block of an extent file, its data blocks have no header
+// (on index levels an extent is a child map block and the number of data blocks below it)
+typedef struct {
+  // data blocks of the file (below this map block)
+  uint32_t blocks;
+  // used extents
+  uint16_t count;
+  // 0, if the extents point to data blocks
+  uint16_t level;
+  TFS_FILE_EXT ext[];
+} _PACKED TFS_EXT_BLK;
+
+#define TFS_EXT_BLK_ITEMS ((TFS_BLOCKSIZE - sizeof(TFS_EXT_BLK)) / sizeof(TFS_FILE_EXT))
+
+// index levels above the leaves, 3 levels hold more extents than a file can have blocks
+#define TFS_EXT_MAX_LEVEL 3
+
+// number of data blocks of an extent file holding 'size' bytes
+#define TFS_EXT_DATA_BLOCKS(size) (((size) >> TFS_BLOCKSIZE_WIDTH) + (((size) & (TFS_BLOCKSIZE - 1)) != 0))
+
+#define FILE_ITEM(type) (TFS_DIR_ITEM_TYPE(type) == TFS_DIR_ITEM_FILE)
+#define TFS_NEW_FILE_TYPE (TFS_DIR_ITEM_FILE | TFS_DIR_ITEM_EXTENTS)
+#else
+// extent files are unknown without TFS_EXTENT_FILES
+#define FILE_ITEM(type) ((type) == TFS_DIR_ITEM_FILE)
+#define TFS_NEW_FILE_TYPE TFS_DIR_ITEM_FILE
+#endif
+
+// superblock, the parent pointer of the root directory points to it
+// (volumes without superblock have 0 there)
+#define TFS_SUPER_MAGIC 0x53465454
+
+typedef struct {
+  uint32_t magic;
+  // bitmap groups from this one on were never written and are free
+  uint32_t bitmap_hwm;
+  // first block of the deleted block chains waiting to be freed,
+  // the 'prev' pointer of this block links the next chain
+  uint32_t reclaim;
+  // layout of this block, 0 on volumes with the three fields above only
+  uint16_t version;
+  uint16_t flags;
+  // TFS_FEAT_* bits of the builds that wrote the volume
+  uint32_t features;
+  // number of used blocks (TFS_USED_INVAL if not known) and the bitmap block
+  // to continue allocating at, valid if TFS_SUPER_CLEAN is set
+  uint32_t used;
+  uint32_t cursor;
+} _PACKED TFS_SUPER_BLK;
+
+#define TFS_SUPER_VERSION 1
+
+// the bitmap on disk matches the allocation state above,
+// cleared on disk before the first block is allocated or freed
+#define TFS_SUPER_CLEAN 0x0001
+
+// features of the lower half are skipped by builds not knowing them,
+// volumes with unknown features of the upper half are not mounted
+#define TFS_FEAT_EXTENTS  0x00000001
+// the first block of a chain file holds the tail pointer, builds that
+// truncate chains without updating it must not write the volume
+#define TFS_FEAT_TAIL     0x00010000
+#define TFS_FEAT_INCOMPAT 0xffff0000
+
+#ifdef TFS_EXTENT_FILES
+#define TFS_FEATURES (TFS_FEAT_EXTENTS | TFS_FEAT_TAIL)
+#else
+#define TFS_FEATURES TFS_FEAT_TAIL
+#endif
+
+#define TFS_HWM_NONE 0xffffffff
+
+#define TFS_RECLAIM_ALL 0xffffffff
+
 typedef union {
   uint8_t raw[TFS_BLOCKSIZE];
   TFS_DIR_BLK dir;
   TFS_DATA_BLK data;
+  TFS_SUPER_BLK super;
+#ifdef TFS_EXTENT_FILES
+  TFS_EXT_BLK ext;
+#endif
 } TFS_BLK_BUFFER;
 
 TFS_DRIVE_INFO tfs_drive_info;
@@ -42,6 +145,19 @@ typedef struct {
   uint32_t first_blk;
   uint32_t curr_blk;
   uint32_t curr_pos;
+  // prev pointer of the first block, the block holding the file end
+  // (TFS_TAIL_INVAL, if not read yet)
+  uint32_t tail;
+#ifdef TFS_EXTENT_FILES
+  // file is stored as extent map, first_blk is the map block
+  uint8_t extents;
+#endif
+#ifdef TFS_SEEK_INDEX
+  // checkpoints of the block chain, entry k is the block holding
+  // data block number k << seek_shift (0 if not known yet)
+  uint32_t seek_index[TFS_SEEK_INDEX];
+  uint8_t seek_shift;
+#endif
 } TFS_FILEHANDLE;
 
 static TFS_FILEHANDLE handles[TFS_MAX_FDS];
@@ -51,10 +167,30 @@ static TFS_FILEHANDLE handles[TFS_MAX_FDS];
 #define SEEK_EOF    2
 #define SEEK_APPEND 3
 
+#define TFS_TAIL_INVAL 0xffffffff
+
 static uint8_t item_usage_count(TFS_DIR_ITEM *item);
 static void init_pos(TFS_FILEHANDLE *hnd);
 static void update_dir_item(TFS_FILEHANDLE *hnd);
+#ifdef TFS_EXTENT_FILES
+static void ext_update_item(TFS_FILEHANDLE *hnd);
+#endif
 static uint8_t seek(TFS_FILEHANDLE *hnd, uint32_t pos, uint8_t append);
+static uint8_t load_tail(TFS_FILEHANDLE *hnd);
+static void tail_start(TFS_FILEHANDLE *hnd, uint32_t pos);
+static void update_tail(TFS_FILEHANDLE *hnd);
+static void clear_file_end(TFS_FILEHANDLE *hnd);
+#ifdef TFS_SEEK_INDEX
+static void seek_index_put(TFS_FILEHANDLE *hnd);
+static void seek_index_start(TFS_FILEHANDLE *hnd, uint32_t pos);
+static void seek_index_cut(TFS_FILEHANDLE *hnd);
+#endif
+
+#ifdef TFS_SEEK_INDEX
+#define SEEK_INDEX_PUT(hnd) seek_index_put(hnd)
+#else
+#define SEEK_INDEX_PUT(hnd)
+#endif
 
 #endif
 
@@ -69,313 +205,2717 @@ static uint8_t seek(TFS_FILEHANDLE *hnd, uint32_t pos, uint8_t append);
 #define TFS_FILENAME_CMP(ref, cmp) (strncmp(ref, cmp, TFS_NAME_LEN) == 0)
 #endif
 
+#ifdef TFS_DRIVE_PREFETCH
+#define PREFETCH_CHAIN(pos, count) prefetch_chain(pos, count)
+#else
+#define PREFETCH_CHAIN(pos, count)
+#endif
+
+#ifdef TFS_CACHE_BLOCKS
+
+#ifndef TFS_CACHE_WAYS
+#define TFS_CACHE_WAYS 4
+#endif
+
+#define TFS_CACHE_SETS (TFS_CACHE_BLOCKS / TFS_CACHE_WAYS)
+
+#define TFS_CACHE_BLK_INVAL 0xffffffff
+
+typedef struct {
+  uint32_t blk;
+  uint8_t dirty;
+  uint8_t age;
+  uint8_t data[TFS_BLOCKSIZE];
+} TFS_CACHE_ENTRY;
+
+static TFS_CACHE_ENTRY cache[TFS_CACHE_BLOCKS];
+
+uint32_t tfs_cache_hits;
+uint32_t tfs_cache_misses;
+
+static TFS_CACHE_ENTRY *cache_set(uint32_t pos);
+static TFS_CACHE_ENTRY *cache_lookup(uint32_t pos);
+static void cache_touch(TFS_CACHE_ENTRY *entry);
+static TFS_CACHE_ENTRY *cache_get(uint32_t pos, uint8_t load);
+static void cache_sync(uint32_t pos, uint16_t count);
+#ifdef TFS_DRIVE_MULTI_BLOCK
+static void cache_inval(uint32_t pos, uint16_t count);
+#endif
+static void cache_flush(void);
+static void read_block(uint32_t pos, uint8_t *data);
+static void write_block(uint32_t pos, const uint8_t *data);
+
+#else
+
+#define read_block(pos, data)  drive_read_block(pos, data)
+#define write_block(pos, data) drive_write_block(pos, data)
+
+#endif
+
 static uint32_t last_bitmap_blk;
 static uint16_t last_bitmap_len;
 static uint32_t loaded_bitmap_blk;
+#ifdef TFS_BITMAP_RESIDENT
+// bitmap blocks of the first TFS_BITMAP_RESIDENT groups, read by tfs_init
+// and written back by tfs_flush, bitmap_blk points to the loaded one
+static uint8_t bitmap_mem[TFS_BITMAP_RESIDENT][TFS_BLOCKSIZE];
+// one bit per resident group, set if the group differs from the disk
+static uint8_t bitmap_mem_dirty[(TFS_BITMAP_RESIDENT + 7) >> 3];
+// number of resident groups on this device
+static uint32_t bitmap_res;
+// buffer for groups behind the resident ones
+static uint8_t bitmap_buf[TFS_BLOCKSIZE];
+static uint8_t *bitmap_blk = bitmap_buf;
+#else
 static uint8_t bitmap_blk[TFS_BLOCKSIZE];
+#endif
+// loaded bitmap block was modified and is written back
+// before an other one is loaded or at the end of the operation
+static uint8_t bitmap_dirty;
+
+// superblock of the volume, super_blk is 0 if there is none
+// and bitmap_hwm is TFS_HWM_NONE then
+static uint32_t super_blk;
+static TFS_SUPER_BLK super;
+
+// error of the last tfs_init (or a failed tfs_format), the volume is
+// not used while it is set, so a refused volume is never written
+static uint8_t mount_error;
+
+#ifdef TFS_BITMAP_SUMMARY
+// one bit per bitmap group (of the first TFS_BITMAP_SUMMARY groups),
+// set if the group is known to have no free block
+static uint8_t bitmap_full[(TFS_BITMAP_SUMMARY + 7) >> 3];
+#endif
+
+#ifdef TFS_FREE_EXTENTS
+#define TFS_EXT_INVAL  0
+#define TFS_EXT_READY  1
+#define TFS_EXT_FAILED 2
+
+typedef struct {
+  uint32_t start;
+  uint32_t len;
+  // longest extent in the subtree
+  uint32_t max_len;
+  uint32_t left;
+  uint32_t right;
+  uint8_t level;
+} TFS_EXTENT;
+
+// AA tree of the free extents ordered by start block, built from the
+// bitmap on first use, node 0 is the empty node
+static TFS_EXTENT ext_nodes[TFS_FREE_EXTENTS + 1];
+static uint32_t ext_root;
+// released nodes, linked by 'right'
+static uint32_t ext_free;
+// nodes taken from ext_nodes so far
+static uint32_t ext_used;
+// TFS_EXT_FAILED if there were more than TFS_FREE_EXTENTS extents,
+// the bitmap is searched then
+static uint8_t ext_state;
+#endif
+
+// number of bitmap groups searched for a contiguous run
+#define TFS_RUN_SEARCH_GROUPS 4
+
+#define TFS_USED_INVAL 0xffffffff
+
+// number of used blocks, counted on first request and updated on
+// every allocation, TFS_USED_INVAL if not yet counted
+static uint32_t used_blocks;
+
+// contiguous run of blocks reserved for the current operation,
+// alloc_block takes the blocks in order, unused ones are released at the end
+static uint32_t run_blk;
+static uint16_t run_len;
+// blocks announced by reserve_blocks, still to be allocated
+static uint32_t run_want;
 
 static uint32_t current_dir_blk;
 static uint32_t loaded_dir_blk;
 
 static TFS_BLK_BUFFER blk_buf;
 
+// block held unmodified in blk_buf, 0 if none
+// (block 0 is a bitmap block and never loaded to blk_buf)
+static uint32_t buf_blk;
+
+#ifdef TFS_DRIVE_MULTI_BLOCK
+static TFS_DATA_HDR multi_hdr[TFS_MULTI_BLOCK_MAX];
+#endif
+
+#ifdef TFS_DRIVE_STREAM
+// directory item found by a streaming lookup
+static TFS_DIR_ITEM lookup_item;
+#endif
+
 static void load_bitmap(uint32_t pos);
-static uint32_t alloc_block(void);
+static void sync_bitmap(void);
+static void init_bitmap(uint8_t *bitmap, uint32_t pos);
+static void init_groups(void);
+static void read_super(void);
+static void write_super(uint8_t *buf);
+static void sync_super(void);
+static void mark_clean(void);
+#ifdef TFS_BITMAP_RESIDENT
+static void read_bitmaps(void);
+static void flush_bitmaps(void);
+#endif
+static uint16_t find_free_bit(const uint8_t *bitmap, uint16_t from);
+static uint16_t count_used_bits(const uint8_t *bitmap);
+#ifdef TFS_BITMAP_SUMMARY
+static uint8_t group_full(uint32_t pos);
+static void mark_group(uint32_t pos, uint8_t full);
+#define GROUP_FULL(pos) group_full(pos)
+#else
+#define GROUP_FULL(pos) 0
+#endif
+static uint16_t find_free_run(const uint8_t *bitmap, uint16_t want, uint16_t from, uint16_t *start);
+static uint16_t load_goal(uint32_t goal);
+static void alloc_block_run(uint16_t count, uint32_t goal);
+static void reserve_blocks(uint32_t count);
+static void begin_alloc(void);
+static void finish_alloc(void);
+static uint32_t alloc_block(uint32_t goal);
+static uint32_t take_block(uint32_t goal);
+static uint32_t alloc_single_block(uint32_t goal);
 static void free_block(uint32_t pos);
+#ifdef TFS_FREE_EXTENTS
+static uint8_t ext_ready(void);
+static void ext_build(void);
+static uint32_t ext_alloc(uint32_t goal, uint16_t want, uint16_t *count);
+static void ext_add(uint32_t start, uint32_t len);
+static void ext_take(uint32_t blk, uint32_t len);
+static void ext_put(uint32_t start, uint32_t len);
+static uint32_t ext_find_le(uint32_t blk);
+static uint32_t ext_first_fit(uint32_t t, uint32_t from, uint32_t want);
+static uint32_t ext_longest(void);
+static void ext_update(uint32_t t);
+static uint32_t ext_skew(uint32_t t);
+static uint32_t ext_split(uint32_t t);
+static uint32_t ext_insert(uint32_t t, uint32_t node);
+static uint32_t ext_delete(uint32_t t, uint32_t start);
+#endif
 static void free_file_blocks(uint32_t pos);
+static TFS_DATA_BLK *reclaim_buf(uint8_t full);
+static void reclaim(uint32_t count, uint8_t full);
 static void write_dir_cleanup(void);
+static void load_buf(uint32_t pos);
+static void store_buf(uint32_t pos);
+static const TFS_BLK_BUFFER *map_block(uint32_t pos);
+static void buffer_block(const TFS_BLK_BUFFER *blk, uint32_t pos);
 static TFS_DIR_ITEM *find_file(const char *name, uint8_t want_free_item);
+#ifdef TFS_DRIVE_STREAM
+static const TFS_DIR_ITEM *lookup_file(const char *name);
+#else
+#define lookup_file(name) find_file(name, 0)
+#endif
+static void read_data_part(uint32_t pos, uint8_t *data, uint16_t offs, uint16_t len);
+static uint32_t read_data_blocks(uint32_t pos, uint8_t *data, uint32_t count);
+static uint32_t write_data_blocks(uint32_t pos, uint32_t *prev, const uint8_t *data, uint32_t count);
+#ifdef TFS_DRIVE_PREFETCH
+static void prefetch_chain(uint32_t pos, uint32_t count);
+#endif
+#ifdef TFS_EXTENT_FILES
+static void read_raw_blocks(uint32_t pos, uint8_t *data, uint32_t count);
+static void write_raw_blocks(uint32_t pos, const uint8_t *data, uint32_t count);
+static uint32_t ext_file_map(uint32_t map, uint32_t idx, uint32_t *count);
+static void ext_file_extend(uint32_t *map, uint32_t blocks, uint32_t goal);
+static uint8_t ext_file_last_leaf(uint32_t map, uint32_t *path);
+static void ext_file_grow(uint32_t map, uint32_t count);
+static void ext_file_add_leaf(const uint32_t *path, uint8_t depth, uint32_t goal);
+static void ext_file_free(uint32_t map, uint32_t keep);
+static uint32_t ext_file_read(uint32_t map, uint8_t *data, uint32_t len, uint32_t offset);
+static uint32_t ext_file_write(uint32_t map, const uint8_t *data, uint32_t len, uint32_t offset, uint32_t fresh);
+#endif
 
-static void load_bitmap(uint32_t pos) {
-  drive_read_block(pos, bitmap_blk);
-  if (tfs_last_error != TFS_ERR_OK) {
-    loaded_bitmap_blk = TFS_BITMAP_BLK_INVAL;
-    return;
+#ifdef TFS_CACHE_BLOCKS
+static TFS_CACHE_ENTRY *cache_set(uint32_t pos) {
+  // hash bitmap group into set index, so bitmap blocks do not share one set
+  return &cache[((pos ^ (pos >> TFS_BITMAP_BLK_SHIFT)) % TFS_CACHE_SETS) * TFS_CACHE_WAYS];
+}
+
+static TFS_CACHE_ENTRY *cache_lookup(uint32_t pos) {
+  TFS_CACHE_ENTRY *entry;
+  uint8_t i;
+
+  entry = cache_set(pos);
+  for (i = 0; i < TFS_CACHE_WAYS; i++, entry++) {
+    if (entry->blk == pos) {
+      return entry;
+    }
   }
 
-  loaded_bitmap_blk = pos;
+  return NULL;
 }
 
-static uint32_t alloc_block(void) {
-  uint32_t start, pos;
-  uint32_t block;
-  uint16_t i;
-  uint8_t *p;
-  uint8_t mask;
+static void cache_touch(TFS_CACHE_ENTRY *entry) {
+  TFS_CACHE_ENTRY *p;
+  uint8_t i;
 
-  // no current bitmap block -> full was detected
-  if (loaded_bitmap_blk == TFS_BITMAP_BLK_INVAL) {
-    tfs_last_error = TFS_ERR_DISK_FULL;
-    return 0;
+  // make entry the most recently used one of its set
+  p = &cache[((entry - cache) / TFS_CACHE_WAYS) * TFS_CACHE_WAYS];
+  for (i = 0; i < TFS_CACHE_WAYS; i++, p++) {
+    if (p->age < entry->age) {
+      p->age++;
+    }
   }
+  entry->age = 0;
+}
 
-  start = loaded_bitmap_blk;
-  pos = loaded_bitmap_blk;
-  while (1) {
-    // serach for free block in current bitmap block
-    for (i = 0, p = bitmap_blk, block = pos; i < TFS_BLOCKSIZE; i++, p++, block += 8) {
-      if (*p != 0xff) {
-        for (mask = 1; mask != 0; mask <<= 1, block++) {
-          if ((*p & mask) == 0) {
-            // check if block is within valid range
-            if (block >= tfs_drive_info.blk_count) {
-              // exit both loops to move to next bitmap block
-              goto next_bitmap;
-            }
-            
-            // free block found, mark as used
-            *p |= mask;
-
-            // write updated bitmap block
-            drive_write_block(loaded_bitmap_blk, bitmap_blk);
-            if (tfs_last_error != TFS_ERR_OK) {
-              return 0;
-            }
-
-            return block;
-          }
-        }
-      }
-    }
+static TFS_CACHE_ENTRY *cache_get(uint32_t pos, uint8_t load) {
+  TFS_CACHE_ENTRY *entry, *victim;
 
-next_bitmap:
-    // no free block found, go to next one
-    // turn around on end of disk
-    if (pos == last_bitmap_blk) {
-      pos = TFS_FIRST_BITMAP_BLK;
-    } else {
-      pos += TFS_BITMAP_BLK_COUNT;
+  entry = cache_lookup(pos);
+  if (entry != NULL) {
+    if (load) {
+      tfs_cache_hits++;
     }
+    cache_touch(entry);
+    return entry;
+  }
 
-    // disk is full if we're back to where we have started
-    if (pos == start) {
-      loaded_bitmap_blk = TFS_BITMAP_BLK_INVAL;
-      tfs_last_error = TFS_ERR_DISK_FULL;
-      return 0;
+  if (load) {
+    tfs_cache_misses++;
+  }
+
+  // replace least recently used entry
+  for (victim = cache_set(pos); victim->age != TFS_CACHE_WAYS - 1; victim++);
+
+  // write back evicted block
+  if (victim->dirty) {
+    drive_write_block(victim->blk, victim->data);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return NULL;
     }
+    victim->dirty = 0;
+  }
 
-    // read next block
-    load_bitmap(pos);
+  victim->blk = TFS_CACHE_BLK_INVAL;
+  if (load) {
+    drive_read_block(pos, victim->data);
     if (tfs_last_error != TFS_ERR_OK) {
-      return 0;
+      return NULL;
     }
   }
+
+  victim->blk = pos;
+  cache_touch(victim);
+  return victim;
 }
 
-static void free_block(uint32_t pos) {
-  uint32_t tmp;
-  uint8_t mask;
-  uint16_t offset;
+static void cache_sync(uint32_t pos, uint16_t count) {
+  TFS_CACHE_ENTRY *entry;
 
-  // load corrosponding bitmap block
-  tmp = GET_BITMAP_BLK(pos);
-  if (loaded_bitmap_blk != tmp) {
-    load_bitmap(tmp);
-    if (tfs_last_error != TFS_ERR_OK) {
-      return;
+  // write back dirty blocks, before the device is accessed directly
+  for (; count > 0; count--, pos++) {
+    entry = cache_lookup(pos);
+    if (entry != NULL && entry->dirty) {
+      drive_write_block(pos, entry->data);
+      if (tfs_last_error != TFS_ERR_OK) {
+        return;
+      }
+      entry->dirty = 0;
     }
   }
+}
 
-  // mark block as unused
-  offset = pos & TFS_BITMAP_BLK_MASK;
-  mask = 1 << (offset & 0x07);
-  offset >>= 3;
-  bitmap_blk[offset] &= ~mask;
+#ifdef TFS_DRIVE_MULTI_BLOCK
+static void cache_inval(uint32_t pos, uint16_t count) {
+  TFS_CACHE_ENTRY *entry;
 
-  // write block
-  drive_write_block(loaded_bitmap_blk, bitmap_blk);
-  if (tfs_last_error != TFS_ERR_OK) {
-    return;
+  // drop blocks, that got written to the device directly
+  for (; count > 0; count--, pos++) {
+    entry = cache_lookup(pos);
+    if (entry != NULL) {
+      entry->blk = TFS_CACHE_BLK_INVAL;
+      entry->dirty = 0;
+    }
   }
 }
 
-static void free_file_blocks(uint32_t pos) {
-  while (pos != 0) {
-    drive_read_block(pos, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
-      return;
-    }
-    free_block(pos);
-    if (tfs_last_error != TFS_ERR_OK) {
-      return;
+#endif
+
+static void cache_flush(void) {
+  TFS_CACHE_ENTRY *entry;
+  uint16_t i;
+
+  for (i = 0, entry = cache; i < TFS_CACHE_BLOCKS; i++, entry++) {
+    if (entry->dirty) {
+      drive_write_block(entry->blk, entry->data);
+      if (tfs_last_error != TFS_ERR_OK) {
+        return;
+      }
+      entry->dirty = 0;
     }
-    pos = blk_buf.data.next;
   }
 }
 
-static void write_dir_cleanup(void) {
-  uint8_t i;
-  TFS_DIR_ITEM *p;
-  uint32_t prev, next;
+static void read_block(uint32_t pos, uint8_t *data) {
+  TFS_CACHE_ENTRY *entry;
 
-  // this block is the last one -> do normal write
-  if (blk_buf.dir.prev == 0 && blk_buf.dir.next == 0) {
-    drive_write_block(loaded_dir_blk, blk_buf.raw);
+  entry = cache_get(pos, 1);
+  if (entry == NULL) {
     return;
   }
 
-  // check for completly empty directory block
-  for (i = 0, p = blk_buf.dir.items; i < TFS_DIR_BLK_ITEMS; i++, p++) {
-    if (p->type != TFS_DIR_ITEM_FREE) {
-      // not empty -> do normal write
-      drive_write_block(loaded_dir_blk, blk_buf.raw);
-      return;
-    }
-  }
+  memcpy(data, entry->data, TFS_BLOCKSIZE);
+}
 
-  // remember pointers
-  prev = blk_buf.dir.prev;
-  next = blk_buf.dir.next;
+static void write_block(uint32_t pos, const uint8_t *data) {
+  TFS_CACHE_ENTRY *entry;
+  uint8_t err;
 
-  if (prev == 0) {
-    // we are on list head, so move the next block to this position
-    drive_read_block(next, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
-      return;
-    }
+  // blocks may be written with a pending error (e.g. disk full),
+  // keep it unless the write fails itself
+  err = tfs_last_error;
+  tfs_last_error = TFS_ERR_OK;
 
-    blk_buf.dir.prev = 0;
+  entry = cache_get(pos, 0);
+  if (entry == NULL) {
+    return;
+  }
 
-    // exchange pointers
-    prev = loaded_dir_blk;
-    loaded_dir_blk = next;
-    next = blk_buf.dir.next;
-  } else {
-    // update prev
-    drive_read_block(prev, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
-      return;
-    }
+  memcpy(entry->data, data, TFS_BLOCKSIZE);
+  entry->dirty = 1;
+  tfs_last_error = err;
+}
+#endif
 
-    blk_buf.dir.next = next;
+static void load_buf(uint32_t pos) {
+  // skip read, if the block is already in buffer
+  if (buf_blk == pos) {
+    return;
   }
 
-  // write updated block
-  drive_write_block(prev, blk_buf.raw);
+  buf_blk = 0;
+  read_block(pos, blk_buf.raw);
   if (tfs_last_error != TFS_ERR_OK) {
     return;
   }
 
-  if (next != 0) {
-    // update next
-    drive_read_block(next, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
-      return;
-    }
+  buf_blk = pos;
+}
 
-    blk_buf.dir.prev = prev;
+static void store_buf(uint32_t pos) {
+  buf_blk = 0;
+  write_block(pos, blk_buf.raw);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
 
-    drive_write_block(next, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
-      return;
-    }
+  buf_blk = pos;
+}
+
+static void load_bitmap(uint32_t pos) {
+  // write back modified bitmap block first
+  sync_bitmap();
+  if (bitmap_dirty) {
+    loaded_bitmap_blk = TFS_BITMAP_BLK_INVAL;
+    return;
   }
 
-  // free unused block
-  free_block(loaded_dir_blk);
+#ifdef TFS_BITMAP_RESIDENT
+  // resident groups are only switched
+  if ((pos >> TFS_BITMAP_BLK_SHIFT) < bitmap_res) {
+    bitmap_blk = bitmap_mem[pos >> TFS_BITMAP_BLK_SHIFT];
+    loaded_bitmap_blk = pos;
+    return;
+  }
+  bitmap_blk = bitmap_buf;
+#endif
+
+  // groups above the high-water mark are free and not yet written
+  if ((pos >> TFS_BITMAP_BLK_SHIFT) >= super.bitmap_hwm) {
+    init_bitmap(bitmap_blk, pos);
+    loaded_bitmap_blk = pos;
+    return;
+  }
+
+  read_block(pos, bitmap_blk);
+  if (tfs_last_error != TFS_ERR_OK) {
+    loaded_bitmap_blk = TFS_BITMAP_BLK_INVAL;
+    return;
+  }
+
+  loaded_bitmap_blk = pos;
 }
 
-static TFS_DIR_ITEM *find_file(const char *name, uint8_t want_free_item) {
-  uint32_t pos = current_dir_blk;
-  uint8_t i;
-  TFS_DIR_ITEM *p;
-  uint32_t free_blk = 0;
-  int8_t free_item = -1;
+static void sync_bitmap(void) {
+  uint8_t err;
+#ifdef TFS_BITMAP_RESIDENT
+  uint32_t group;
+#endif
 
-  // check for name
-  if (*name == 0) {
-    tfs_last_error = TFS_ERR_NO_NAME;
-    return NULL;
+  if (!bitmap_dirty) {
+    return;
   }
 
-  while (1) {
-    // read current directory block
-    drive_read_block(pos, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
-      return NULL;
-    }
-    loaded_dir_blk = pos;
+#ifdef TFS_BITMAP_RESIDENT
+  // resident groups are written by tfs_flush
+  if (bitmap_blk != bitmap_buf) {
+    group = loaded_bitmap_blk >> TFS_BITMAP_BLK_SHIFT;
+    bitmap_mem_dirty[group >> 3] |= 1 << (group & 0x07);
+    bitmap_dirty = 0;
+    return;
+  }
+#endif
 
-    // iterrate items
-    for (i = 0, p = blk_buf.dir.items; i < TFS_DIR_BLK_ITEMS; i++, p++) {
-      if (p->type == TFS_DIR_ITEM_FREE) {
+  // keep an earlier error, the allocation state must be written anyway
+  err = tfs_last_error;
+  tfs_last_error = TFS_ERR_OK;
+  write_block(loaded_bitmap_blk, bitmap_blk);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+
+  bitmap_dirty = 0;
+  tfs_last_error = err;
+}
+
+static void init_bitmap(uint8_t *bitmap, uint32_t pos) {
+  uint16_t offset;
+
+  // bitmap block of an empty group,
+  // first block always in use (the bitmapblock itself)
+  memset(bitmap, 0, TFS_BLOCKSIZE);
+  bitmap[0] = 1;
+
+  // mark all blocks after end of disk as used
+  if (pos == last_bitmap_blk && last_bitmap_len < TFS_BITMAP_BLK_COUNT) {
+    offset = last_bitmap_len >> 3;
+    bitmap[offset] |= 0xff << (last_bitmap_len & 0x07);
+    for (offset++; offset < TFS_BLOCKSIZE; offset++) {
+      bitmap[offset] = 0xff;
+    }
+  }
+}
+
+static void init_groups(void) {
+  uint32_t group, hwm;
+
+  // called before the first block of the loaded group is marked as used,
+  // writes the empty bitmap blocks up to this group and moves the high-water mark,
+  // bitmap_blk holds an empty group here and is used as buffer
+  group = loaded_bitmap_blk >> TFS_BITMAP_BLK_SHIFT;
+  if (group < super.bitmap_hwm) {
+    return;
+  }
+
+  hwm = super.bitmap_hwm;
+  for (; super.bitmap_hwm <= group; super.bitmap_hwm++) {
+    init_bitmap(bitmap_blk, super.bitmap_hwm << TFS_BITMAP_BLK_SHIFT);
+    write_block(super.bitmap_hwm << TFS_BITMAP_BLK_SHIFT, bitmap_blk);
+    if (tfs_last_error != TFS_ERR_OK) {
+      break;
+    }
+  }
+
+  // the bitmap blocks are on disk before the superblock refers to them
+  if (tfs_last_error == TFS_ERR_OK) {
+    write_super(bitmap_blk);
+  }
+  if (tfs_last_error != TFS_ERR_OK) {
+    super.bitmap_hwm = hwm;
+  }
+
+  init_bitmap(bitmap_blk, loaded_bitmap_blk);
+}
+
+static void read_super(void) {
+  uint32_t pos;
+
+  // volumes without superblock have all bitmap blocks written
+  super_blk = 0;
+  memset(&super, 0, sizeof(TFS_SUPER_BLK));
+  super.bitmap_hwm = TFS_HWM_NONE;
+
+  load_buf(TFS_ROOT_DIR_BLK);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+
+  pos = blk_buf.dir.parent;
+  if (pos == 0) {
+    return;
+  }
+
+  load_buf(pos);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+
+  // not a superblock, the volume is corrupt or no TinyFS volume
+  if (blk_buf.super.magic != TFS_SUPER_MAGIC) {
+    tfs_last_error = TFS_ERR_FEATURE;
+    return;
+  }
+
+  // newer layouts and unknown incompatible features are refused
+  if (blk_buf.super.version > TFS_SUPER_VERSION ||
+      (blk_buf.super.features & TFS_FEAT_INCOMPAT & ~TFS_FEATURES) != 0) {
+    tfs_last_error = TFS_ERR_FEATURE;
+    return;
+  }
+
+  super_blk = pos;
+  memcpy(&super, &blk_buf.super, sizeof(TFS_SUPER_BLK));
+}
+
+static void write_super(uint8_t *buf) {
+  // 'buf' may be blk_buf, so the buffered copy is dropped
+  if (buf == blk_buf.raw || buf_blk == super_blk) {
+    buf_blk = 0;
+  }
+
+  memset(buf, 0, TFS_BLOCKSIZE);
+  memcpy(buf, &super, sizeof(TFS_SUPER_BLK));
+  write_block(super_blk, buf);
+}
+
+static void sync_super(void) {
+#ifdef TFS_CACHE_BLOCKS
+  // the clean flag is ordered against the other blocks,
+  // so it does not wait in the cache
+  if (tfs_last_error == TFS_ERR_OK) {
+    cache_sync(super_blk, 1);
+  }
+#endif
+}
+
+static void mark_clean(void) {
+  uint32_t cursor;
+
+  if (super_blk == 0) {
+    return;
+  }
+
+  // allocation continues in the loaded group on next mount
+  cursor = loaded_bitmap_blk;
+  if (cursor == TFS_BITMAP_BLK_INVAL) {
+    cursor = TFS_FIRST_BITMAP_BLK;
+  }
+
+  // nothing allocated since the last flush?
+  if ((super.flags & TFS_SUPER_CLEAN) != 0 && super.used == used_blocks) {
+    return;
+  }
+
+  // called with all bitmap blocks on disk
+  super.flags |= TFS_SUPER_CLEAN;
+  super.used = used_blocks;
+  super.cursor = cursor;
+  // on errors the flag stays set in RAM, so the next change clears it again
+  write_super(blk_buf.raw);
+  sync_super();
+}
+
+#ifdef TFS_BITMAP_RESIDENT
+static void read_bitmaps(void) {
+  uint32_t group;
+
+  // read the bitmap blocks of all resident groups
+  bitmap_res = (last_bitmap_blk >> TFS_BITMAP_BLK_SHIFT) + 1;
+  if (bitmap_res > TFS_BITMAP_RESIDENT) {
+    bitmap_res = TFS_BITMAP_RESIDENT;
+  }
+
+  memset(bitmap_mem_dirty, 0, sizeof(bitmap_mem_dirty));
+  for (group = 0; group < bitmap_res; group++) {
+    // groups above the high-water mark are not on disk
+    if (group >= super.bitmap_hwm) {
+      init_bitmap(bitmap_mem[group], group << TFS_BITMAP_BLK_SHIFT);
+      continue;
+    }
+
+    read_block(group << TFS_BITMAP_BLK_SHIFT, bitmap_mem[group]);
+    if (tfs_last_error != TFS_ERR_OK) {
+      bitmap_res = 0;
+      return;
+    }
+  }
+}
+
+static void flush_bitmaps(void) {
+  uint32_t group;
+
+  // write back all modified resident groups
+  for (group = 0; group < bitmap_res; group++) {
+    if ((bitmap_mem_dirty[group >> 3] & (1 << (group & 0x07))) == 0) {
+      continue;
+    }
+
+    write_block(group << TFS_BITMAP_BLK_SHIFT, bitmap_mem[group]);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    bitmap_mem_dirty[group >> 3] &= ~(1 << (group & 0x07));
+  }
+}
+#endif
+
+#ifdef TFS_BITMAP_WORD_SCAN
+static uint64_t bitmap_word(const uint8_t *bitmap, uint16_t i) {
+  uint64_t w;
+
+  // load 64 bits of the bitmap, bit n is block n of the word
+  memcpy(&w, bitmap + (i << 3), sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+  return w;
+}
+
+static uint16_t find_free_bit(const uint8_t *bitmap, uint16_t from) {
+  uint16_t i, n;
+  uint64_t w;
+
+  // returns the first clear bit at or after 'from', continuing at the
+  // start of the block, or TFS_BITMAP_BLK_COUNT if all are set
+  i = from >> 6;
+  w = ~bitmap_word(bitmap, i) & (~(uint64_t) 0 << (from & 0x3f));
+  for (n = 0; n <= TFS_BLOCKSIZE / sizeof(w); n++) {
+    if (w != 0) {
+      return (i << 6) + __builtin_ctzll(w);
+    }
+
+    i = (i + 1) & (TFS_BLOCKSIZE / sizeof(w) - 1);
+    w = ~bitmap_word(bitmap, i);
+  }
+
+  return TFS_BITMAP_BLK_COUNT;
+}
+
+static uint16_t count_used_bits(const uint8_t *bitmap) {
+  uint16_t i, used = 0;
+
+  for (i = 0; i < TFS_BLOCKSIZE / sizeof(uint64_t); i++) {
+    used += __builtin_popcountll(bitmap_word(bitmap, i));
+  }
+
+  return used;
+}
+#else
+static uint16_t find_free_bit(const uint8_t *bitmap, uint16_t from) {
+  uint16_t i, n, bit;
+  uint8_t free, mask;
+
+  // returns the first clear bit at or after 'from', continuing at the
+  // start of the block, or TFS_BITMAP_BLK_COUNT if all are set
+  i = from >> 3;
+  free = ~bitmap[i] & (0xff << (from & 0x07));
+  for (n = 0; n <= TFS_BLOCKSIZE; n++) {
+    if (free != 0) {
+      for (mask = 1, bit = i << 3; (free & mask) == 0; mask <<= 1, bit++);
+      return bit;
+    }
+
+    i = (i + 1) & (TFS_BLOCKSIZE - 1);
+    free = ~bitmap[i];
+  }
+
+  return TFS_BITMAP_BLK_COUNT;
+}
+
+static uint16_t count_used_bits(const uint8_t *bitmap) {
+  uint16_t i, used = 0;
+  uint8_t mask;
+
+  for (i = 0; i < TFS_BLOCKSIZE; i++, bitmap++) {
+    if (*bitmap > 0) {
+      for (mask = 1; mask != 0; mask <<= 1) {
+        if ((*bitmap & mask) != 0) {
+          used++;
+        }
+      }
+    }
+  }
+
+  return used;
+}
+#endif
+
+#ifdef TFS_BITMAP_SUMMARY
+static uint8_t group_full(uint32_t pos) {
+  pos >>= TFS_BITMAP_BLK_SHIFT;
+  if (pos >= TFS_BITMAP_SUMMARY) {
+    return 0;
+  }
+
+  return (bitmap_full[pos >> 3] >> (pos & 0x07)) & 1;
+}
+
+static void mark_group(uint32_t pos, uint8_t full) {
+  pos >>= TFS_BITMAP_BLK_SHIFT;
+  if (pos >= TFS_BITMAP_SUMMARY) {
+    return;
+  }
+
+  if (full) {
+    bitmap_full[pos >> 3] |= 1 << (pos & 0x07);
+  } else {
+    bitmap_full[pos >> 3] &= ~(1 << (pos & 0x07));
+  }
+}
+#endif
+
+static uint16_t find_free_run(const uint8_t *bitmap, uint16_t want, uint16_t from, uint16_t *start) {
+  uint16_t n, bit, len, best;
+  uint8_t b;
+
+  // returns the length of the first run of 'want' clear bits at or after 'from',
+  // continuing at the start of the block, or of the longest shorter one,
+  // 'start' is set to its first bit
+  for (n = 0, bit = from, len = 0, best = 0; n < TFS_BITMAP_BLK_COUNT; n++, bit = (bit + 1) & TFS_BITMAP_BLK_MASK) {
+    // runs do not continue over the block end
+    if (bit == 0) {
+      len = 0;
+    }
+
+    b = bitmap[bit >> 3];
+    if (((b >> (bit & 0x07)) & 1) != 0) {
+      // skip completely used bytes
+      if (b == 0xff) {
+        n += 0x07 - (bit & 0x07);
+        bit |= 0x07;
+      }
+      len = 0;
+      continue;
+    }
+
+    len++;
+    if (len > best) {
+      best = len;
+      *start = bit + 1 - len;
+      if (best == want) {
+        break;
+      }
+    }
+  }
+
+  return best;
+}
+
+static uint16_t load_goal(uint32_t goal) {
+  uint32_t pos;
+
+  // loads the bitmap group of the 'goal' block and returns its bit,
+  // the loaded group is kept, if there is no goal or its group is full
+  if (goal == 0 || goal >= tfs_drive_info.blk_count) {
+    return 0;
+  }
+
+  pos = GET_BITMAP_BLK(goal);
+  if (pos != loaded_bitmap_blk) {
+    if (GROUP_FULL(pos)) {
+      return 0;
+    }
+
+    load_bitmap(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return 0;
+    }
+  }
+
+  return goal & TFS_BITMAP_BLK_MASK;
+}
+
+static void alloc_block_run(uint16_t count, uint32_t goal) {
+  uint32_t start, pos, best_pos = 0;
+  uint16_t from, bit, len, best = 0, best_bit = 0;
+  uint8_t i;
+
+  // reserves the first run of 'count' free blocks at or after the 'goal' block
+  // in the next TFS_RUN_SEARCH_GROUPS bitmap groups, or the longest run found there
+#ifdef TFS_FREE_EXTENTS
+  if (ext_ready()) {
+    run_blk = ext_alloc(goal, count, &run_len);
+    return;
+  }
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+#endif
+
+  if (loaded_bitmap_blk == TFS_BITMAP_BLK_INVAL) {
+    tfs_last_error = TFS_ERR_DISK_FULL;
+    return;
+  }
+
+  from = load_goal(goal);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+
+  start = loaded_bitmap_blk;
+  pos = loaded_bitmap_blk;
+  for (i = 1; ; i++, from = 0) {
+    len = find_free_run(bitmap_blk, count, from, &bit);
+
+    // limit run to disk end
+    if (len > 0 && pos + bit + len > tfs_drive_info.blk_count) {
+      len = (pos + bit < tfs_drive_info.blk_count) ? tfs_drive_info.blk_count - pos - bit : 0;
+    }
+
+    if (len > best) {
+      best = len;
+      best_bit = bit;
+      best_pos = pos;
+    }
+
+#ifdef TFS_BITMAP_SUMMARY
+    if (len == 0) {
+      mark_group(pos, 1);
+    }
+#endif
+
+    if (best == count || i == TFS_RUN_SEARCH_GROUPS) {
+      break;
+    }
+
+    // go to next group, skip groups known to be full
+    do {
+      if (pos == last_bitmap_blk) {
+        pos = TFS_FIRST_BITMAP_BLK;
+      } else {
+        pos += TFS_BITMAP_BLK_COUNT;
+      }
+    } while (pos != start && GROUP_FULL(pos));
+
+    if (pos == start) {
+      break;
+    }
+
+    load_bitmap(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+  }
+
+  // nothing found in the searched groups, take a single block from anywhere
+  if (best == 0) {
+    run_blk = alloc_single_block(goal);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+    run_len = 1;
+    return;
+  }
+
+  if (loaded_bitmap_blk != best_pos) {
+    load_bitmap(best_pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+  }
+
+  init_groups();
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+
+  // mark run as used
+  run_blk = best_pos + best_bit;
+  run_len = best;
+  for (len = 0, bit = best_bit; len < best; len++, bit++) {
+    bitmap_blk[bit >> 3] |= 1 << (bit & 0x07);
+  }
+  if (used_blocks != TFS_USED_INVAL) {
+    used_blocks += best;
+  }
+  bitmap_dirty = 1;
+}
+
+static void reserve_blocks(uint32_t count) {
+  // announce the number of blocks the operation is going to allocate,
+  // alloc_block takes them from contiguous runs then
+  run_want = count;
+}
+
+static void begin_alloc(void) {
+  uint16_t flags;
+
+  // called at the start of every operation that may allocate or free blocks,
+  // before blk_buf is used, the hints of the superblock get stale with
+  // the first change, so the volume is marked unclean on disk before
+  if (super_blk == 0) {
+    return;
+  }
+  if ((super.flags & TFS_SUPER_CLEAN) == 0 && super.version == TFS_SUPER_VERSION &&
+      (super.features & TFS_FEATURES) == TFS_FEATURES) {
+    return;
+  }
+
+  flags = super.flags;
+  super.flags &= ~TFS_SUPER_CLEAN;
+  super.version = TFS_SUPER_VERSION;
+  super.features |= TFS_FEATURES;
+  write_super(blk_buf.raw);
+  sync_super();
+  if (tfs_last_error != TFS_ERR_OK) {
+    // try again with the next operation
+    super.flags = flags;
+  }
+}
+
+static void finish_alloc(void) {
+  uint8_t err;
+
+  // release blocks of the reserved run that were not used
+  // and write back the bitmap at the end of an operation,
+  // an earlier error is kept
+  err = tfs_last_error;
+  tfs_last_error = TFS_ERR_OK;
+
+  run_want = 0;
+  for (; run_len > 0; run_len--, run_blk++) {
+    free_block(run_blk);
+  }
+
+#ifdef TFS_RECLAIM_STEP
+  // free some blocks of deleted files on every operation
+  if (err == TFS_ERR_OK && tfs_last_error == TFS_ERR_OK) {
+    reclaim(TFS_RECLAIM_STEP, 0);
+  }
+#endif
+
+  sync_bitmap();
+  if (tfs_last_error == TFS_ERR_OK) {
+    tfs_last_error = err;
+  }
+}
+
+static uint32_t alloc_block(uint32_t goal) {
+  uint32_t pos;
+
+  // allocates a free block, preferably the 'goal' block or the next free one after it,
+  // 0 for no preference continues in the loaded bitmap group
+  pos = take_block(goal);
+
+#ifdef TFS_RECLAIM_STEP
+  // disk is full, free blocks of deleted files and try again
+  while (tfs_last_error == TFS_ERR_DISK_FULL && super.reclaim != 0) {
+    tfs_last_error = TFS_ERR_OK;
+    reclaim(TFS_RECLAIM_STEP, 1);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return 0;
+    }
+
+    load_bitmap(TFS_FIRST_BITMAP_BLK);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return 0;
+    }
+
+    pos = take_block(goal);
+  }
+#endif
+
+  return pos;
+}
+
+static uint32_t take_block(uint32_t goal) {
+  // refill the reserved run, as long as more blocks are announced
+  if (run_len == 0 && run_want > 1) {
+    alloc_block_run(run_want > TFS_BITMAP_BLK_COUNT ? TFS_BITMAP_BLK_COUNT : run_want, goal);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return 0;
+    }
+  }
+
+  if (run_want > 0) {
+    run_want--;
+  }
+
+  // take the next block of the reserved run
+  if (run_len > 0) {
+    run_len--;
+    return run_blk++;
+  }
+
+  return alloc_single_block(goal);
+}
+
+static uint32_t alloc_single_block(uint32_t goal) {
+  uint32_t start, pos;
+  uint32_t block;
+  uint16_t from, bit;
+
+#ifdef TFS_FREE_EXTENTS
+  // take the block from the free extent index
+  if (ext_ready()) {
+    return ext_alloc(goal, 1, &bit);
+  }
+  if (tfs_last_error != TFS_ERR_OK) {
+    return 0;
+  }
+#endif
+
+  // no current bitmap block -> full was detected
+  if (loaded_bitmap_blk == TFS_BITMAP_BLK_INVAL) {
+    tfs_last_error = TFS_ERR_DISK_FULL;
+    return 0;
+  }
+
+  // start in the group of the goal block
+  from = load_goal(goal);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return 0;
+  }
+
+  start = loaded_bitmap_blk;
+  pos = loaded_bitmap_blk;
+  while (1) {
+    // serach for free block in current bitmap block
+    bit = find_free_bit(bitmap_blk, from);
+    from = 0;
+    block = pos + bit;
+
+    // check if block is within valid range
+    if (bit < TFS_BITMAP_BLK_COUNT && block < tfs_drive_info.blk_count) {
+      init_groups();
+      if (tfs_last_error != TFS_ERR_OK) {
+        return 0;
+      }
+
+      // free block found, mark as used
+      bitmap_blk[bit >> 3] |= 1 << (bit & 0x07);
+      if (used_blocks != TFS_USED_INVAL) {
+        used_blocks++;
+      }
+
+      // bitmap block is written at the end of the operation
+      bitmap_dirty = 1;
+      return block;
+    }
+
+#ifdef TFS_BITMAP_SUMMARY
+    // remember full group, so it is skipped without reading next time
+    mark_group(pos, 1);
+#endif
+
+    // no free block found, go to next one
+    // skip groups known to be full
+    do {
+      // turn around on end of disk
+      if (pos == last_bitmap_blk) {
+        pos = TFS_FIRST_BITMAP_BLK;
+      } else {
+        pos += TFS_BITMAP_BLK_COUNT;
+      }
+
+      // disk is full if we're back to where we have started
+      if (pos == start) {
+        sync_bitmap();
+        loaded_bitmap_blk = TFS_BITMAP_BLK_INVAL;
+        tfs_last_error = TFS_ERR_DISK_FULL;
+        return 0;
+      }
+    } while (GROUP_FULL(pos));
+
+    // read next block
+    load_bitmap(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return 0;
+    }
+  }
+}
+
+static void free_block(uint32_t pos) {
+  uint32_t tmp;
+  uint8_t mask;
+  uint16_t offset;
+
+  // load corrosponding bitmap block
+  tmp = GET_BITMAP_BLK(pos);
+  if (loaded_bitmap_blk != tmp) {
+    load_bitmap(tmp);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+  }
+
+  // mark block as unused
+  offset = pos & TFS_BITMAP_BLK_MASK;
+  mask = 1 << (offset & 0x07);
+  offset >>= 3;
+  if ((bitmap_blk[offset] & mask) != 0) {
+    if (used_blocks != TFS_USED_INVAL) {
+      used_blocks--;
+    }
+#ifdef TFS_FREE_EXTENTS
+    if (ext_state == TFS_EXT_READY) {
+      ext_add(pos, 1);
+    }
+#endif
+  }
+  bitmap_blk[offset] &= ~mask;
+#ifdef TFS_BITMAP_SUMMARY
+  mark_group(tmp, 0);
+#endif
+
+  // bitmap block is written at the end of the operation
+  bitmap_dirty = 1;
+}
+
+static void free_file_blocks(uint32_t pos) {
+#ifdef TFS_RECLAIM_STEP
+  // queue the chain in the superblock, its blocks are freed later by reclaim
+  if (super_blk != 0) {
+    if (pos == 0) {
+      return;
+    }
+
+    load_buf(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    buf_blk = 0;
+    blk_buf.data.prev = super.reclaim;
+    store_buf(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    super.reclaim = pos;
+    write_super(blk_buf.raw);
+    return;
+  }
+#endif
+
+  while (pos != 0) {
+    load_buf(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+    PREFETCH_CHAIN(blk_buf.data.next, 1);
+    free_block(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+    pos = blk_buf.data.next;
+  }
+}
+
+static TFS_DATA_BLK *reclaim_buf(uint8_t full) {
+  // blk_buf is used, if it is free
+  if (!full) {
+    buf_blk = 0;
+    return &blk_buf.data;
+  }
+
+  // on a full disk blk_buf is in use, so the bitmap buffer is taken,
+  // its changes are written back first
+  sync_bitmap();
+  if (tfs_last_error != TFS_ERR_OK) {
+    return NULL;
+  }
+  loaded_bitmap_blk = TFS_BITMAP_BLK_INVAL;
+#ifdef TFS_BITMAP_RESIDENT
+  bitmap_blk = bitmap_buf;
+#endif
+  return (TFS_DATA_BLK *) bitmap_blk;
+}
+
+static void reclaim(uint32_t count, uint8_t full) {
+  TFS_DATA_BLK *blk;
+  uint32_t pos, next, rest;
+  uint8_t head;
+
+  // frees up to 'count' blocks of the queued chains
+  pos = super.reclaim;
+  if (pos == 0) {
+    return;
+  }
+
+  rest = 0;
+  head = 1;
+  for (; count > 0 && pos != 0; count--) {
+    blk = reclaim_buf(full);
+    if (blk == NULL) {
+      return;
+    }
+    read_block(pos, (uint8_t *) blk);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    // first block of a chain links the remaining ones
+    if (head) {
+      rest = blk->prev;
+    }
+    next = blk->next;
+
+    free_block(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    // continue with the next chain at the end of this one
+    head = (next == 0);
+    pos = head ? rest : next;
+  }
+
+  // stopped within a chain, its new first block takes the link
+  if (!head) {
+    blk = reclaim_buf(full);
+    if (blk == NULL) {
+      return;
+    }
+    read_block(pos, (uint8_t *) blk);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    blk->prev = rest;
+    write_block(pos, (uint8_t *) blk);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+  }
+
+  blk = reclaim_buf(full);
+  if (blk == NULL) {
+    return;
+  }
+  super.reclaim = pos;
+  write_super((uint8_t *) blk);
+}
+
+#ifdef TFS_FREE_EXTENTS
+static uint8_t ext_ready(void) {
+  // the index is built on first use
+  if (ext_state == TFS_EXT_INVAL) {
+    ext_build();
+  }
+
+  return ext_state == TFS_EXT_READY;
+}
+
+static void ext_build(void) {
+  uint32_t start, pos, used, len;
+  uint16_t bit;
+  uint8_t b;
+
+  // collects all free runs of the bitmap, blocks are counted on the way
+  start = loaded_bitmap_blk;
+  ext_root = 0;
+  ext_free = 0;
+  ext_used = 0;
+  ext_state = TFS_EXT_READY;
+
+  pos = TFS_FIRST_BITMAP_BLK;
+  used = 0;
+  while (1) {
+    load_bitmap(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      ext_state = TFS_EXT_INVAL;
+      return;
+    }
+
+    for (bit = 0, len = 0; bit < TFS_BITMAP_BLK_COUNT; bit++) {
+      b = bitmap_blk[bit >> 3];
+
+      // free block extends the run
+      if (((b >> (bit & 0x07)) & 1) == 0) {
+        // take completely free bytes at once
+        if (b == 0x00 && (bit & 0x07) == 0) {
+          len += 7;
+          bit += 7;
+        }
+        len++;
+        continue;
+      }
+
+      if (len > 0) {
+        ext_put(pos + bit - len, len);
+        len = 0;
+      }
+
+      // take completely used bytes at once
+      if (b == 0xff && (bit & 0x07) == 0) {
+        used += 7;
+        bit += 7;
+      }
+      used++;
+    }
+
+    // group ends with free blocks
+    if (len > 0) {
+      ext_put(pos + bit - len, len);
+    }
+
+    // too many extents?
+    if (ext_state != TFS_EXT_READY) {
+      break;
+    }
+
+    // check for end of list
+    if (pos == last_bitmap_blk) {
+      // blocks after disk end are marked as used, so substract them
+      used_blocks = used - (TFS_BITMAP_BLK_COUNT - last_bitmap_len);
+      break;
+    }
+
+    pos += TFS_BITMAP_BLK_COUNT;
+  }
+
+  // allocation without goal continues in the group loaded before
+  if (start != TFS_BITMAP_BLK_INVAL) {
+    load_bitmap(start);
+  }
+}
+
+static uint32_t ext_alloc(uint32_t goal, uint16_t want, uint16_t *count) {
+  const TFS_EXTENT *e;
+  uint32_t t, blk, avail, pos;
+  uint16_t bit, i, n;
+
+  // takes up to 'want' blocks of one extent, preferably at or after the 'goal' block,
+  // the first extent holding 'want' blocks or the longest one otherwise
+  *count = 0;
+
+  // no goal -> continue in the loaded bitmap group
+  if (goal == 0 || goal >= tfs_drive_info.blk_count) {
+    goal = (loaded_bitmap_blk != TFS_BITMAP_BLK_INVAL) ? loaded_bitmap_blk : 0;
+  }
+
+  // goal block itself is free?
+  t = ext_find_le(goal);
+  e = &ext_nodes[t];
+  if (t != 0 && goal - e->start < e->len && e->start + e->len - goal >= want) {
+    blk = goal;
+    avail = e->start + e->len - goal;
+  } else {
+    t = ext_first_fit(ext_root, goal, want);
+    if (t == 0) {
+      t = ext_first_fit(ext_root, 0, want);
+    }
+    if (t == 0) {
+      t = ext_longest();
+    }
+    if (t == 0) {
+      tfs_last_error = TFS_ERR_DISK_FULL;
+      return 0;
+    }
+
+    blk = ext_nodes[t].start;
+    avail = ext_nodes[t].len;
+  }
+  n = (avail < want) ? avail : want;
+
+  // mark blocks as used in the bitmap
+  pos = GET_BITMAP_BLK(blk);
+  if (loaded_bitmap_blk != pos) {
+    load_bitmap(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return 0;
+    }
+  }
+  init_groups();
+  if (tfs_last_error != TFS_ERR_OK) {
+    return 0;
+  }
+  for (bit = blk & TFS_BITMAP_BLK_MASK, i = 0; i < n; i++, bit++) {
+    bitmap_blk[bit >> 3] |= 1 << (bit & 0x07);
+  }
+  if (used_blocks != TFS_USED_INVAL) {
+    used_blocks += n;
+  }
+  bitmap_dirty = 1;
+
+  ext_take(blk, n);
+  *count = n;
+  return blk;
+}
+
+static void ext_add(uint32_t start, uint32_t len) {
+  uint32_t t, next;
+
+  // adds a free extent, merged with its neighbours
+  t = ext_find_le(start);
+  if (t != 0 && ext_nodes[t].start + ext_nodes[t].len == start) {
+    start = ext_nodes[t].start;
+    len += ext_nodes[t].len;
+    ext_root = ext_delete(ext_root, start);
+  }
+
+  t = ext_find_le(start + len);
+  if (t != 0 && ext_nodes[t].start == start + len) {
+    next = ext_nodes[t].len;
+    ext_root = ext_delete(ext_root, start + len);
+    len += next;
+  }
+
+  ext_put(start, len);
+}
+
+static void ext_take(uint32_t blk, uint32_t len) {
+  uint32_t t, start, end;
+
+  // removes the blocks from the extent holding them
+  t = ext_find_le(blk);
+  start = ext_nodes[t].start;
+  end = start + ext_nodes[t].len;
+  ext_root = ext_delete(ext_root, start);
+
+  if (blk > start) {
+    ext_put(start, blk - start);
+  }
+  if (blk + len < end) {
+    ext_put(blk + len, end - blk - len);
+  }
+}
+
+static void ext_put(uint32_t start, uint32_t len) {
+  uint32_t t;
+  TFS_EXTENT *e;
+
+  // get a node, fall back to the bitmap search if there are too many extents
+  if (ext_free != 0) {
+    t = ext_free;
+    ext_free = ext_nodes[t].right;
+  } else if (ext_used < TFS_FREE_EXTENTS) {
+    t = ++ext_used;
+  } else {
+    ext_state = TFS_EXT_FAILED;
+    return;
+  }
+
+  e = &ext_nodes[t];
+  e->start = start;
+  e->len = len;
+  e->max_len = len;
+  e->left = 0;
+  e->right = 0;
+  e->level = 1;
+  ext_root = ext_insert(ext_root, t);
+}
+
+static uint32_t ext_find_le(uint32_t blk) {
+  uint32_t t, res;
+
+  // returns the extent starting at or last before 'blk', 0 if none
+  for (t = ext_root, res = 0; t != 0; ) {
+    if (ext_nodes[t].start <= blk) {
+      res = t;
+      t = ext_nodes[t].right;
+    } else {
+      t = ext_nodes[t].left;
+    }
+  }
+
+  return res;
+}
+
+static uint32_t ext_first_fit(uint32_t t, uint32_t from, uint32_t want) {
+  uint32_t res;
+
+  // returns the first extent starting at or after 'from' with at least 'want' blocks
+  if (t == 0 || ext_nodes[t].max_len < want) {
+    return 0;
+  }
+
+  if (ext_nodes[t].start >= from) {
+    res = ext_first_fit(ext_nodes[t].left, from, want);
+    if (res != 0) {
+      return res;
+    }
+    if (ext_nodes[t].len >= want) {
+      return t;
+    }
+  }
+
+  return ext_first_fit(ext_nodes[t].right, from, want);
+}
+
+static uint32_t ext_longest(void) {
+  uint32_t t;
+
+  // follow the subtree holding the longest extent
+  for (t = ext_root; t != 0 && ext_nodes[t].len != ext_nodes[t].max_len; ) {
+    if (ext_nodes[ext_nodes[t].left].max_len == ext_nodes[t].max_len) {
+      t = ext_nodes[t].left;
+    } else {
+      t = ext_nodes[t].right;
+    }
+  }
+
+  return t;
+}
+
+static void ext_update(uint32_t t) {
+  TFS_EXTENT *e = &ext_nodes[t];
+
+  e->max_len = e->len;
+  if (ext_nodes[e->left].max_len > e->max_len) {
+    e->max_len = ext_nodes[e->left].max_len;
+  }
+  if (ext_nodes[e->right].max_len > e->max_len) {
+    e->max_len = ext_nodes[e->right].max_len;
+  }
+}
+
+static uint32_t ext_skew(uint32_t t) {
+  uint32_t l;
+
+  // rotate right, if the left child is on the same level
+  l = ext_nodes[t].left;
+  if (t == 0 || l == 0 || ext_nodes[l].level != ext_nodes[t].level) {
+    return t;
+  }
+
+  ext_nodes[t].left = ext_nodes[l].right;
+  ext_nodes[l].right = t;
+  ext_update(t);
+  ext_update(l);
+  return l;
+}
+
+static uint32_t ext_split(uint32_t t) {
+  uint32_t r;
+
+  // rotate left, if there are two right children on the same level
+  r = ext_nodes[t].right;
+  if (t == 0 || r == 0 || ext_nodes[r].right == 0 || ext_nodes[ext_nodes[r].right].level != ext_nodes[t].level) {
+    return t;
+  }
+
+  ext_nodes[t].right = ext_nodes[r].left;
+  ext_nodes[r].left = t;
+  ext_nodes[r].level++;
+  ext_update(t);
+  ext_update(r);
+  return r;
+}
+
+static uint32_t ext_insert(uint32_t t, uint32_t node) {
+  if (t == 0) {
+    return node;
+  }
+
+  if (ext_nodes[node].start < ext_nodes[t].start) {
+    ext_nodes[t].left = ext_insert(ext_nodes[t].left, node);
+  } else {
+    ext_nodes[t].right = ext_insert(ext_nodes[t].right, node);
+  }
+  ext_update(t);
+
+  t = ext_skew(t);
+  return ext_split(t);
+}
+
+static uint32_t ext_delete(uint32_t t, uint32_t start) {
+  TFS_EXTENT *e;
+  uint32_t n;
+  uint8_t level;
+
+  if (t == 0) {
+    return 0;
+  }
+
+  e = &ext_nodes[t];
+  if (start < e->start) {
+    e->left = ext_delete(e->left, start);
+  } else if (start > e->start) {
+    e->right = ext_delete(e->right, start);
+  } else if (e->left == 0 && e->right == 0) {
+    // release leaf node
+    e->right = ext_free;
+    ext_free = t;
+    return 0;
+  } else if (e->left == 0) {
+    // replace by successor
+    for (n = e->right; ext_nodes[n].left != 0; n = ext_nodes[n].left);
+    e->start = ext_nodes[n].start;
+    e->len = ext_nodes[n].len;
+    e->right = ext_delete(e->right, e->start);
+  } else {
+    // replace by predecessor
+    for (n = e->left; ext_nodes[n].right != 0; n = ext_nodes[n].right);
+    e->start = ext_nodes[n].start;
+    e->len = ext_nodes[n].len;
+    e->left = ext_delete(e->left, e->start);
+  }
+  ext_update(t);
+
+  // decrease level, if a child got too low
+  level = ext_nodes[e->left].level;
+  if (ext_nodes[e->right].level < level) {
+    level = ext_nodes[e->right].level;
+  }
+  level++;
+  if (level < e->level) {
+    e->level = level;
+    if (ext_nodes[e->right].level > level) {
+      ext_nodes[e->right].level = level;
+    }
+  }
+
+  // rebalance
+  t = ext_skew(t);
+  e = &ext_nodes[t];
+  e->right = ext_skew(e->right);
+  if (e->right != 0) {
+    ext_nodes[e->right].right = ext_skew(ext_nodes[e->right].right);
+  }
+  t = ext_split(t);
+  e = &ext_nodes[t];
+  e->right = ext_split(e->right);
+  return t;
+}
+#endif
+
+static void write_dir_cleanup(void) {
+  uint8_t i;
+  TFS_DIR_ITEM *p;
+  uint32_t prev, next;
+
+  // this block is the last one -> do normal write
+  if (blk_buf.dir.prev == 0 && blk_buf.dir.next == 0) {
+    store_buf(loaded_dir_blk);
+    return;
+  }
+
+  // check for completly empty directory block
+  for (i = 0, p = blk_buf.dir.items; i < TFS_DIR_BLK_ITEMS; i++, p++) {
+    if (p->type != TFS_DIR_ITEM_FREE) {
+      // not empty -> do normal write
+      store_buf(loaded_dir_blk);
+      return;
+    }
+  }
+
+  // remember pointers
+  prev = blk_buf.dir.prev;
+  next = blk_buf.dir.next;
+
+  if (prev == 0) {
+    // we are on list head, so move the next block to this position
+    load_buf(next);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    buf_blk = 0;
+    blk_buf.dir.prev = 0;
+
+    // exchange pointers
+    prev = loaded_dir_blk;
+    loaded_dir_blk = next;
+    next = blk_buf.dir.next;
+  } else {
+    // update prev
+    load_buf(prev);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    buf_blk = 0;
+    blk_buf.dir.next = next;
+  }
+
+  // write updated block
+  store_buf(prev);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+
+  if (next != 0) {
+    // update next
+    load_buf(next);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    buf_blk = 0;
+    blk_buf.dir.prev = prev;
+
+    store_buf(next);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+  }
+
+  // free unused block
+  free_block(loaded_dir_blk);
+}
+
+static const TFS_BLK_BUFFER *map_block(uint32_t pos) {
+#ifdef TFS_CACHE_BLOCKS
+  TFS_CACHE_ENTRY *entry;
+#endif
+#ifdef TFS_DRIVE_MAP_BLOCK
+  const TFS_BLK_BUFFER *blk;
+
+  // access block in place, if the driver is able to map it
+  // (cached blocks may be newer than the device)
+#ifdef TFS_CACHE_BLOCKS
+  if (cache_lookup(pos) == NULL) {
+#else
+  {
+#endif
+    blk = (const TFS_BLK_BUFFER *) drive_map_block(pos);
+    if (blk != NULL) {
+      return blk;
+    }
+  }
+#endif
+
+#ifdef TFS_CACHE_BLOCKS
+  // use cache entry in place
+  entry = cache_get(pos, 1);
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  return (const TFS_BLK_BUFFER *) entry->data;
+#else
+  load_buf(pos);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return NULL;
+  }
+
+  return &blk_buf;
+#endif
+}
+
+static void buffer_block(const TFS_BLK_BUFFER *blk, uint32_t pos) {
+#if defined(TFS_DRIVE_MAP_BLOCK) || defined(TFS_CACHE_BLOCKS)
+  // copy a mapped block to blk_buf for modification
+  if (blk != &blk_buf) {
+    memcpy(blk_buf.raw, blk->raw, TFS_BLOCKSIZE);
+    buf_blk = pos;
+  }
+#endif
+}
+
+static TFS_DIR_ITEM *find_file(const char *name, uint8_t want_free_item) {
+  uint32_t pos = current_dir_blk;
+  uint8_t i;
+  const TFS_BLK_BUFFER *blk;
+  const TFS_DIR_ITEM *p;
+  uint32_t free_blk = 0;
+  int8_t free_item = -1;
+
+  // check for name
+  if (*name == 0) {
+    tfs_last_error = TFS_ERR_NO_NAME;
+    return NULL;
+  }
+
+  while (1) {
+    // read current directory block
+    blk = map_block(pos);
+    if (blk == NULL) {
+      return NULL;
+    }
+    loaded_dir_blk = pos;
+    PREFETCH_CHAIN(blk->dir.next, 1);
+
+    // iterrate items
+    for (i = 0, p = blk->dir.items; i < TFS_DIR_BLK_ITEMS; i++, p++) {
+      if (p->type == TFS_DIR_ITEM_FREE) {
         // remember free item, if found one
         if (free_item < 0) {
           free_blk = pos;
           free_item = i;
         }
       } else {
-        // check filename
-        if (TFS_FILENAME_CMP(name, p->name)) {
-          return p;
+        // check filename
+        if (TFS_FILENAME_CMP(name, p->name)) {
+          buffer_block(blk, pos);
+          return &blk_buf.dir.items[i];
+        }
+      }
+    }
+
+    // go to next block in chain
+    pos = blk->dir.next;
+    if (pos == 0) {
+      break;
+    }
+  }
+
+  // no match found and we do not want a free die item
+  if (!want_free_item) {
+    return NULL;
+  }
+
+  // free item found
+  if (free_item >= 0) {
+    // reload directory block, if an other than the one with the free item is loaded
+    if (loaded_dir_blk != free_blk) {
+      blk = map_block(free_blk);
+      if (blk == NULL) {
+        return NULL;
+      }
+      loaded_dir_blk = free_blk;
+    }
+
+    buffer_block(blk, loaded_dir_blk);
+    return &blk_buf.dir.items[free_item];
+  }
+
+  buffer_block(blk, loaded_dir_blk);
+
+  // now we need a new directory block, so alloc one after the last one
+  free_blk = alloc_block(loaded_dir_blk + 1);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return NULL;
+  }
+
+  // add pointer to new block to last one
+  buf_blk = 0;
+  blk_buf.dir.next = free_blk;
+  store_buf(loaded_dir_blk);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return NULL;
+  }
+
+  // initialize new block
+  // keep some fields from the last one loaded (e.g. type, patent)
+  buf_blk = 0;
+  blk_buf.dir.prev = loaded_dir_blk;
+  blk_buf.dir.next = 0;
+  memset(blk_buf.dir.items, 0, sizeof(TFS_DIR_ITEM) * TFS_DIR_BLK_ITEMS);
+  loaded_dir_blk = free_blk;
+
+  // write block
+  store_buf(free_blk);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return NULL;
+  }
+
+  return blk_buf.dir.items; // first item is free on new block
+}
+
+#ifdef TFS_DRIVE_STREAM
+static const TFS_DIR_ITEM *lookup_file(const char *name) {
+  uint32_t pos = current_dir_blk;
+  uint8_t i;
+  const TFS_DIR_ITEM *p;
+
+  // search a name without buffering the directory blocks,
+  // the returned item is only valid until the next filesystem access
+  // and must not be modified
+  if (*name == 0) {
+    tfs_last_error = TFS_ERR_NO_NAME;
+    return NULL;
+  }
+
+  while (1) {
+    loaded_dir_blk = pos;
+
+    if (buf_blk == pos) {
+      // directory block is already in buffer
+      for (i = 0, p = blk_buf.dir.items; i < TFS_DIR_BLK_ITEMS; i++, p++) {
+        if (p->type != TFS_DIR_ITEM_FREE && TFS_FILENAME_CMP(name, p->name)) {
+          return p;
+        }
+      }
+
+      pos = blk_buf.dir.next;
+    } else {
+      // compare items as they arrive, skip the rest of the block on match
+      drive_stream_open(pos);
+      if (tfs_last_error != TFS_ERR_OK) {
+        return NULL;
+      }
+
+      drive_stream_skip(sizeof(uint32_t));
+      drive_stream_read((uint8_t *) &pos, sizeof(uint32_t));
+      drive_stream_skip(sizeof(uint32_t));
+
+      for (i = 0; i < TFS_DIR_BLK_ITEMS; i++) {
+        drive_stream_read((uint8_t *) &lookup_item, sizeof(TFS_DIR_ITEM));
+        if (lookup_item.type != TFS_DIR_ITEM_FREE && TFS_FILENAME_CMP(name, lookup_item.name)) {
+          drive_stream_close();
+          return &lookup_item;
+        }
+      }
+
+      drive_stream_close();
+    }
+
+    // go to next block in chain
+    if (pos == 0) {
+      return NULL;
+    }
+  }
+}
+#endif
+
+static void read_data_part(uint32_t pos, uint8_t *data, uint16_t offs, uint16_t len) {
+  const TFS_BLK_BUFFER *blk;
+
+  // reads 'len' payload bytes starting at 'offs' of data block 'pos'
+  // the block header is left in blk_buf
+#ifdef TFS_DRIVE_STREAM
+  // stream the requested bytes directly to the user buffer,
+  // if the block is not already in buffer
+  if (buf_blk != pos) {
+    buf_blk = 0;
+    drive_stream_open(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    drive_stream_read((uint8_t *) &blk_buf.data, sizeof(TFS_DATA_BLK));
+    drive_stream_skip(offs);
+    drive_stream_read(data, len);
+    drive_stream_close();
+    return;
+  }
+#endif
+
+  blk = map_block(pos);
+  if (blk == NULL) {
+    return;
+  }
+
+  memcpy(data, blk->data.data + offs, len);
+  if (blk != &blk_buf) {
+    buf_blk = 0;
+    blk_buf.data.prev = blk->data.prev;
+    blk_buf.data.next = blk->data.next;
+  }
+}
+
+static uint32_t read_data_blocks(uint32_t pos, uint8_t *data, uint32_t count) {
+  uint32_t last = 0;
+#ifdef TFS_DRIVE_MULTI_BLOCK
+  uint16_t i, n;
+  uint16_t run = 1;
+#endif
+
+  // reads 'count' full data blocks of the chain starting at 'pos'
+  // returns the last block read, its header is left in blk_buf
+  while (count > 0) {
+    if (pos == 0) {
+      tfs_last_error = TFS_ERR_UNEXP_EOF;
+      return last;
+    }
+
+#ifdef TFS_DRIVE_MULTI_BLOCK
+    // read a run of consecutive blocks in one transfer
+    n = run;
+    if (n > count) {
+      n = count;
+    }
+    if (pos < tfs_drive_info.blk_count && n > tfs_drive_info.blk_count - pos) {
+      n = tfs_drive_info.blk_count - pos;
+    }
+#ifdef TFS_CACHE_BLOCKS
+    cache_sync(pos, n);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return last;
+    }
+#endif
+    drive_read_blocks(pos, n, (uint8_t *) multi_hdr, sizeof(TFS_DATA_HDR), data);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return last;
+    }
+
+    // accept blocks as long as the chain is contiguous,
+    // data of the remaining ones gets overwritten by the next transfer
+    for (i = 1; i < n && multi_hdr[i - 1].next == pos + i; i++);
+
+    // restart with short runs after a discontinuity and grow them again
+    // while the chain stays contiguous, this limits the blocks read in vain
+    if (i < n) {
+      run = 1;
+    } else if (run < TFS_MULTI_BLOCK_MAX) {
+      run <<= 1;
+      if (run > TFS_MULTI_BLOCK_MAX) {
+        run = TFS_MULTI_BLOCK_MAX;
+      }
+    }
+
+    last = pos + i - 1;
+    buf_blk = 0;
+    blk_buf.data.prev = multi_hdr[i - 1].prev;
+    blk_buf.data.next = multi_hdr[i - 1].next;
+    data += (uint32_t) i * TFS_DATA_LEN;
+    count -= i;
+#else
+    // keep the following blocks in flight, while this one is copied
+    PREFETCH_CHAIN(pos, count);
+
+    read_data_part(pos, data, 0, TFS_DATA_LEN);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return last;
+    }
+
+    last = pos;
+    data += TFS_DATA_LEN;
+    count--;
+#endif
+
+    pos = blk_buf.data.next;
+  }
+
+  return last;
+}
+
+static uint32_t write_data_blocks(uint32_t pos, uint32_t *prev, const uint8_t *data, uint32_t count) {
+#ifdef TFS_DRIVE_MULTI_BLOCK
+  uint16_t n;
+  uint32_t next;
+#endif
+
+  // writes 'count' full data blocks to the chain starting at the allocated block 'pos'
+  // a successor is allocated for every block, 'prev' is updated to the last block written
+  // returns the successor of the last block written
+  while (count > 0) {
+#ifdef TFS_DRIVE_MULTI_BLOCK
+    // collect a run, as long as the allocated blocks are consecutive
+    n = 0;
+    while (1) {
+      multi_hdr[n].prev = *prev;
+      next = alloc_block(pos + n + 1);
+      multi_hdr[n].next = next;
+      *prev = pos + n;
+      n++;
+
+      // if error -> try to write the run, error is handled after write
+      if (tfs_last_error != TFS_ERR_OK || n == count || n == TFS_MULTI_BLOCK_MAX || next != pos + n) {
+        break;
+      }
+    }
+
+#ifdef TFS_CACHE_BLOCKS
+    cache_inval(pos, n);
+#endif
+    if (buf_blk >= pos && buf_blk < pos + n) {
+      buf_blk = 0;
+    }
+    drive_write_blocks(pos, n, (const uint8_t *) multi_hdr, sizeof(TFS_DATA_HDR), data);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return 0;
+    }
+
+    pos = next;
+    data += (uint32_t) n * TFS_DATA_LEN;
+    count -= n;
+#else
+    buf_blk = 0;
+    blk_buf.data.prev = *prev;
+    blk_buf.data.next = alloc_block(pos + 1);
+    // if error -> try to write the data block, error is handled after write
+
+    memcpy(blk_buf.data.data, data, TFS_DATA_LEN);
+    store_buf(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return 0;
+    }
+
+    *prev = pos;
+    pos = blk_buf.data.next;
+    data += TFS_DATA_LEN;
+    count--;
+#endif
+  }
+
+  return pos;
+}
+
+#ifdef TFS_DRIVE_PREFETCH
+static void prefetch_chain(uint32_t pos, uint32_t count) {
+  // start reading the next 'count' blocks of a chain,
+  // assuming it continues contiguous
+  if (pos == 0 || count == 0) {
+    return;
+  }
+
+  if (count > 0xffff) {
+    count = 0xffff;
+  }
+
+  drive_prefetch_blocks(pos, count);
+}
+#endif
+
+#ifdef TFS_EXTENT_FILES
+static void read_raw_blocks(uint32_t pos, uint8_t *data, uint32_t count) {
+  uint16_t n;
+
+  // reads 'count' consecutive data blocks of an extent file to 'data'
+  while (count > 0) {
+#ifdef TFS_DRIVE_MULTI_BLOCK
+    // the whole run is transferred at once
+    n = (count > 0xffff) ? 0xffff : count;
+#ifdef TFS_CACHE_BLOCKS
+    cache_sync(pos, n);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+#endif
+    drive_read_blocks(pos, n, NULL, 0, data);
+#else
+    n = 1;
+    read_block(pos, data);
+#endif
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    pos += n;
+    data += (uint32_t) n << TFS_BLOCKSIZE_WIDTH;
+    count -= n;
+  }
+}
+
+static void write_raw_blocks(uint32_t pos, const uint8_t *data, uint32_t count) {
+  uint16_t n;
+
+  // writes 'count' consecutive data blocks of an extent file from 'data'
+  while (count > 0) {
+    n = (count > 0xffff) ? 0xffff : count;
+    if (buf_blk >= pos && buf_blk < pos + n) {
+      buf_blk = 0;
+    }
+
+#ifdef TFS_DRIVE_MULTI_BLOCK
+#ifdef TFS_CACHE_BLOCKS
+    cache_inval(pos, n);
+#endif
+    drive_write_blocks(pos, n, NULL, 0, data);
+#else
+    n = 1;
+    write_block(pos, data);
+#endif
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    pos += n;
+    data += (uint32_t) n << TFS_BLOCKSIZE_WIDTH;
+    count -= n;
+  }
+}
+
+static uint32_t ext_file_map(uint32_t map, uint32_t idx, uint32_t *count) {
+  const TFS_BLK_BUFFER *blk;
+  const TFS_FILE_EXT *e;
+  uint16_t i, level = TFS_EXT_MAX_LEVEL + 1;
+
+  // returns the disk block of data block 'idx' of the extent file with map block 'map',
+  // 'count' is set to the number of blocks following on disk in the same extent (this one included),
+  // 0 if the file has no such block
+  *count = 0;
+  if (map == 0) {
+    return 0;
+  }
+
+  // one map block per level from the root down to the leaf
+  while (1) {
+    blk = map_block(map);
+    if (blk == NULL || idx >= blk->ext.blocks) {
+      return 0;
+    }
+
+    // every level has to be below its parent
+    if (blk->ext.level >= level) {
+      tfs_last_error = TFS_ERR_UNEXP_EOF;
+      return 0;
+    }
+    level = blk->ext.level;
+
+    for (i = 0, e = blk->ext.ext; i < blk->ext.count; i++, e++) {
+      if (idx < e->len) {
+        break;
+      }
+      idx -= e->len;
+    }
+    if (i == blk->ext.count) {
+      tfs_last_error = TFS_ERR_UNEXP_EOF;
+      return 0;
+    }
+
+    if (level == 0) {
+      *count = e->len - idx;
+      return e->start + idx;
+    }
+
+    // index entry, continue with the child map block
+    map = e->start;
+  }
+}
+
+static void ext_file_extend(uint32_t *map, uint32_t blocks, uint32_t goal) {
+  // makes sure the extent file has at least 'blocks' data blocks,
+  // a new map block is allocated near 'goal', if the file has none
+  if (*map == 0) {
+    if (blocks == 0) {
+      return;
+    }
+
+    *map = alloc_block(goal);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    buf_blk = 0;
+    memset(blk_buf.raw, 0, TFS_BLOCKSIZE);
+    store_buf(*map);
+  } else {
+    load_buf(*map);
+  }
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+
+  goal = blk_buf.ext.blocks;
+  if (blocks > goal) {
+    ext_file_grow(*map, blocks - goal);
+  }
+}
+
+static uint8_t ext_file_last_leaf(uint32_t map, uint32_t *path) {
+  uint8_t depth = 0;
+
+  // loads the last leaf of the extent map to blk_buf by following the last entry
+  // of every index block, 'path' gets the map blocks from the root to the leaf,
+  // returns the depth of the leaf (an index block without entries ends the path too)
+  path[0] = map;
+  while (1) {
+    load_buf(path[depth]);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return 0;
+    }
+
+    if (blk_buf.ext.level == 0 || blk_buf.ext.count == 0) {
+      return depth;
+    }
+
+    if (depth == TFS_EXT_MAX_LEVEL) {
+      tfs_last_error = TFS_ERR_UNEXP_EOF;
+      return 0;
+    }
+
+    depth++;
+    path[depth] = blk_buf.ext.ext[blk_buf.ext.count - 1].start;
+  }
+}
+
+static void ext_file_grow(uint32_t map, uint32_t count) {
+  uint32_t path[TFS_EXT_MAX_LEVEL + 1];
+  TFS_FILE_EXT *e;
+  uint32_t pos, goal, added;
+  uint8_t depth, i, err;
+
+  // appends 'count' new blocks to the extent map, the blocks are allocated
+  // behind the last extent, a full leaf gets a new one behind it
+  goal = map + 1;
+  while (count > 0) {
+    depth = ext_file_last_leaf(map, path);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    buf_blk = 0;
+    e = NULL;
+    if (blk_buf.ext.level == 0 && blk_buf.ext.count > 0) {
+      e = &blk_buf.ext.ext[blk_buf.ext.count - 1];
+      goal = e->start + e->len;
+    }
+
+    // fill the leaf
+    for (added = 0; added < count && blk_buf.ext.level == 0; added++) {
+      pos = alloc_block(goal);
+      if (tfs_last_error != TFS_ERR_OK) {
+        break;
+      }
+
+      // extend the last extent or start a new one
+      if (e != NULL && e->start + e->len == pos) {
+        e->len++;
+      } else {
+        if (blk_buf.ext.count == TFS_EXT_BLK_ITEMS) {
+          free_block(pos);
+          break;
+        }
+        e = &blk_buf.ext.ext[blk_buf.ext.count++];
+        e->start = pos;
+        e->len = 1;
+      }
+
+      blk_buf.ext.blocks++;
+      goal = pos + 1;
+    }
+
+    // the leaf and the counters of its index blocks are written in any case, an error is kept
+    err = tfs_last_error;
+    tfs_last_error = TFS_ERR_OK;
+    if (added > 0) {
+      store_buf(path[depth]);
+      for (i = depth; i > 0 && tfs_last_error == TFS_ERR_OK; ) {
+        i--;
+        load_buf(path[i]);
+        if (tfs_last_error != TFS_ERR_OK) {
+          break;
         }
+        buf_blk = 0;
+        blk_buf.ext.blocks += added;
+        blk_buf.ext.ext[blk_buf.ext.count - 1].len += added;
+        store_buf(path[i]);
+      }
+    }
+    if (tfs_last_error == TFS_ERR_OK) {
+      tfs_last_error = err;
+    }
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    count -= added;
+    if (count > 0) {
+      ext_file_add_leaf(path, depth, goal);
+      if (tfs_last_error != TFS_ERR_OK) {
+        return;
+      }
+    }
+  }
+}
+
+static void ext_file_add_leaf(const uint32_t *path, uint8_t depth, uint32_t goal) {
+  TFS_FILE_EXT *e;
+  uint32_t pos, child;
+  int8_t i;
+
+  // adds an empty leaf behind the last one of the extent map with the given path,
+  // the new branch starts at the deepest index block having space,
+  // if there is none, the root moves to a new block and gets one level more
+  for (i = depth; i >= 0; i--) {
+    load_buf(path[i]);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+    if (blk_buf.ext.level > 0 && blk_buf.ext.count < TFS_EXT_BLK_ITEMS) {
+      break;
+    }
+  }
+
+  if (i < 0) {
+    // the root keeps its block, as the directory item points to it
+    if (blk_buf.ext.level == TFS_EXT_MAX_LEVEL) {
+      tfs_last_error = TFS_ERR_DISK_FULL;
+      return;
+    }
+
+    child = alloc_block(goal);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    store_buf(child);
+    if (tfs_last_error != TFS_ERR_OK) {
+      free_block(child);
+      return;
+    }
+
+    buf_blk = 0;
+    blk_buf.ext.level++;
+    blk_buf.ext.count = 1;
+    blk_buf.ext.ext[0].start = child;
+    blk_buf.ext.ext[0].len = blk_buf.ext.blocks;
+    store_buf(path[0]);
+    return;
+  }
+
+  // new blocks down to the leaf, each one is written before it is linked
+  pos = path[i];
+  while (blk_buf.ext.level > 0) {
+    child = alloc_block(goal);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    buf_blk = 0;
+    i = blk_buf.ext.level - 1;
+    memset(blk_buf.raw, 0, TFS_BLOCKSIZE);
+    blk_buf.ext.level = i;
+    store_buf(child);
+    if (tfs_last_error != TFS_ERR_OK) {
+      free_block(child);
+      return;
+    }
+
+    load_buf(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+    buf_blk = 0;
+    e = &blk_buf.ext.ext[blk_buf.ext.count++];
+    e->start = child;
+    e->len = 0;
+    store_buf(pos);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    load_buf(child);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+    pos = child;
+  }
+}
+
+static void ext_file_free(uint32_t map, uint32_t keep) {
+  uint32_t path[TFS_EXT_MAX_LEVEL + 1];
+  TFS_FILE_EXT *e;
+  uint32_t drop, n;
+  uint8_t depth, removed;
+
+  // frees the data blocks of the extent file behind the first 'keep' ones,
+  // leaves and index blocks getting empty are freed on the way,
+  // the root map block is freed too, if no block is kept
+  if (map == 0) {
+    return;
+  }
+
+  while (1) {
+    load_buf(map);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    // done, if all blocks behind 'keep' are freed
+    // (empty index blocks are left for later growth, unless the whole file goes)
+    if (blk_buf.ext.blocks <= keep && (keep > 0 || blk_buf.ext.level == 0 || blk_buf.ext.count == 0)) {
+      break;
+    }
+    drop = blk_buf.ext.blocks - keep;
+
+    depth = ext_file_last_leaf(map, path);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    // free blocks from the end of the leaf
+    buf_blk = 0;
+    if (blk_buf.ext.level != 0) {
+      drop = 0;
+    } else if (drop > blk_buf.ext.blocks) {
+      drop = blk_buf.ext.blocks;
+    }
+    for (n = drop; n > 0; n--) {
+      e = &blk_buf.ext.ext[blk_buf.ext.count - 1];
+      e->len--;
+      blk_buf.ext.blocks--;
+      free_block(e->start + e->len);
+      if (tfs_last_error != TFS_ERR_OK) {
+        return;
+      }
+
+      if (e->len == 0) {
+        blk_buf.ext.count--;
+      }
+    }
+
+    // write back the path, map blocks getting empty are freed (except the root)
+    while (1) {
+      removed = depth > 0 && blk_buf.ext.count == 0;
+      if (removed) {
+        free_block(path[depth]);
+      } else {
+        store_buf(path[depth]);
+      }
+      if (tfs_last_error != TFS_ERR_OK || depth == 0) {
+        break;
+      }
+
+      depth--;
+      load_buf(path[depth]);
+      if (tfs_last_error != TFS_ERR_OK) {
+        return;
+      }
+
+      buf_blk = 0;
+      e = &blk_buf.ext.ext[blk_buf.ext.count - 1];
+      e->len -= drop;
+      blk_buf.ext.blocks -= drop;
+      if (removed) {
+        blk_buf.ext.count--;
+      }
+    }
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+  }
+
+  if (keep == 0) {
+    free_block(map);
+  }
+}
+
+static uint32_t ext_file_read(uint32_t map, uint8_t *data, uint32_t len, uint32_t offset) {
+  const TFS_BLK_BUFFER *blk;
+  uint32_t pos, count;
+  uint32_t blk_os, blk_len;
+  uint32_t ret = 0;
+
+  // reads 'len' bytes at 'offset' of the extent file,
+  // full blocks of an extent are transferred at once
+  while (len > 0) {
+    pos = ext_file_map(map, offset >> TFS_BLOCKSIZE_WIDTH, &count);
+    if (tfs_last_error != TFS_ERR_OK) {
+      break;
+    }
+    if (pos == 0) {
+      tfs_last_error = TFS_ERR_UNEXP_EOF;
+      break;
+    }
+
+    blk_os = offset & (TFS_BLOCKSIZE - 1);
+    if (blk_os != 0 || len < TFS_BLOCKSIZE) {
+      // partial block
+      blk_len = TFS_BLOCKSIZE - blk_os;
+      if (blk_len > len) {
+        blk_len = len;
+      }
+
+      blk = map_block(pos);
+      if (blk == NULL) {
+        break;
       }
+      memcpy(data, blk->raw + blk_os, blk_len);
+    } else {
+      // full blocks directly to user buffer
+      if (count > len >> TFS_BLOCKSIZE_WIDTH) {
+        count = len >> TFS_BLOCKSIZE_WIDTH;
+      }
+
+      read_raw_blocks(pos, data, count);
+      if (tfs_last_error != TFS_ERR_OK) {
+        break;
+      }
+      blk_len = count << TFS_BLOCKSIZE_WIDTH;
     }
 
-    // go to next block in chain
-    pos = blk_buf.dir.next;
+    data += blk_len;
+    len -= blk_len;
+    offset += blk_len;
+    ret += blk_len;
+  }
+
+  return ret;
+}
+
+static uint32_t ext_file_write(uint32_t map, const uint8_t *data, uint32_t len, uint32_t offset, uint32_t fresh) {
+  uint32_t idx, pos, count;
+  uint32_t blk_os, blk_len;
+  uint32_t ret = 0;
+
+  // writes 'len' bytes at 'offset' of the extent file to its allocated blocks,
+  // zeros if 'data' is NULL, blocks from 'fresh' on are new and not read before
+  while (len > 0) {
+    idx = offset >> TFS_BLOCKSIZE_WIDTH;
+    pos = ext_file_map(map, idx, &count);
+    if (tfs_last_error != TFS_ERR_OK) {
+      break;
+    }
     if (pos == 0) {
+      tfs_last_error = TFS_ERR_UNEXP_EOF;
       break;
     }
-  }
-
-  // no match found and we do not want a free die item
-  if (!want_free_item) {
-    return NULL;
-  }
 
-  // free item found
-  if (free_item >= 0) {
-    // reload directory block, if an other than the one with the free item is loaded
-    if (loaded_dir_blk != free_blk) {
-      drive_read_block(free_blk, blk_buf.raw);
-      if (tfs_last_error != TFS_ERR_OK) {
-        return NULL;
+    blk_os = offset & (TFS_BLOCKSIZE - 1);
+    if (blk_os != 0 || len < TFS_BLOCKSIZE) {
+      // partial block, the rest of a new one is zeroed
+      blk_len = TFS_BLOCKSIZE - blk_os;
+      if (blk_len > len) {
+        blk_len = len;
       }
-      loaded_dir_blk = free_blk;
-    }
 
-    return &blk_buf.dir.items[free_item];
-  }
-
-  // now we need a new directory block, so alloc one
-  free_blk = alloc_block();
-  if (tfs_last_error != TFS_ERR_OK) {
-    return NULL;
-  }
+      if (idx < fresh) {
+        load_buf(pos);
+        if (tfs_last_error != TFS_ERR_OK) {
+          break;
+        }
+      } else {
+        memset(blk_buf.raw, 0, TFS_BLOCKSIZE);
+      }
 
-  // add pointer to new block to last one
-  blk_buf.dir.next = free_blk;
-  drive_write_block(loaded_dir_blk, blk_buf.raw);
-  if (tfs_last_error != TFS_ERR_OK) {
-    return NULL;
-  }
+      buf_blk = 0;
+      if (data != NULL) {
+        memcpy(blk_buf.raw + blk_os, data, blk_len);
+      } else {
+        memset(blk_buf.raw + blk_os, 0, blk_len);
+      }
+      store_buf(pos);
+    } else {
+      // full blocks directly from user buffer
+      if (count > len >> TFS_BLOCKSIZE_WIDTH) {
+        count = len >> TFS_BLOCKSIZE_WIDTH;
+      }
+      blk_len = count << TFS_BLOCKSIZE_WIDTH;
 
-  // initialize new block
-  // keep some fields from the last one loaded (e.g. type, patent)
-  blk_buf.dir.prev = loaded_dir_blk;
-  blk_buf.dir.next = 0;
-  memset(blk_buf.dir.items, 0, sizeof(TFS_DIR_ITEM) * TFS_DIR_BLK_ITEMS);
-  loaded_dir_blk = free_blk;
+      if (data != NULL) {
+        write_raw_blocks(pos, data, count);
+      } else {
+        buf_blk = 0;
+        memset(blk_buf.raw, 0, TFS_BLOCKSIZE);
+        for (; count > 0 && tfs_last_error == TFS_ERR_OK; count--, pos++) {
+          write_block(pos, blk_buf.raw);
+        }
+      }
+    }
+    if (tfs_last_error != TFS_ERR_OK) {
+      break;
+    }
 
-  // write block
-  drive_write_block(free_blk, blk_buf.raw);
-  if (tfs_last_error != TFS_ERR_OK) {
-    return NULL;
+    if (data != NULL) {
+      data += blk_len;
+    }
+    len -= blk_len;
+    offset += blk_len;
+    ret += blk_len;
   }
 
-  return blk_buf.dir.items; // first item is free on new block
+  return ret;
 }
+#endif
 
 void tfs_init(void) {
+  uint32_t pos;
+#ifdef TFS_CACHE_BLOCKS
+  uint16_t i;
+#endif
 
 #ifdef TFS_EXTENDED_API
   memset(handles, 0, sizeof(handles));
 #endif
 
+#ifdef TFS_CACHE_BLOCKS
+  // invalidate cache, initialize LRU order
+  for (i = 0; i < TFS_CACHE_BLOCKS; i++) {
+    cache[i].blk = TFS_CACHE_BLK_INVAL;
+    cache[i].dirty = 0;
+    cache[i].age = i % TFS_CACHE_WAYS;
+  }
+  tfs_cache_hits = 0;
+  tfs_cache_misses = 0;
+#endif
+
+  buf_blk = 0;
+  bitmap_dirty = 0;
+  used_blocks = TFS_USED_INVAL;
+#ifdef TFS_BITMAP_SUMMARY
+  memset(bitmap_full, 0, sizeof(bitmap_full));
+#endif
+#ifdef TFS_FREE_EXTENTS
+  ext_state = TFS_EXT_INVAL;
+#endif
+
   tfs_last_error = TFS_ERR_OK;
   drive_init();
   if (tfs_last_error != TFS_ERR_OK) {
+    mount_error = tfs_last_error;
     return;
   }
 
@@ -385,26 +2925,66 @@ void tfs_init(void) {
   last_bitmap_len = (last_bitmap_blk & TFS_BITMAP_BLK_MASK) + 1;
   last_bitmap_blk = GET_BITMAP_BLK(last_bitmap_blk);
 
-  load_bitmap(TFS_FIRST_BITMAP_BLK);
+  read_super();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
+#ifdef TFS_BITMAP_RESIDENT
+  read_bitmaps();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+#endif
+
+  // a clean volume tells the number of used blocks
+  // and the group allocation continued in
+  pos = TFS_FIRST_BITMAP_BLK;
+  if ((super.flags & TFS_SUPER_CLEAN) != 0) {
+    if (super.used == TFS_USED_INVAL || super.used <= tfs_drive_info.blk_count) {
+      used_blocks = super.used;
+    }
+    if (super.cursor <= last_bitmap_blk && (super.cursor & TFS_BITMAP_BLK_MASK) == 0) {
+      pos = super.cursor;
+    }
+  }
+
+  load_bitmap(pos);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
+#ifndef TFS_RECLAIM_STEP
+  // free the chains left queued by a port with deferred reclaim
+  if (super.reclaim != 0) {
+    begin_alloc();
+    if (tfs_last_error != TFS_ERR_OK) {
+      goto out;
+    }
+    reclaim(TFS_RECLAIM_ALL, 0);
+    sync_bitmap();
+    if (tfs_last_error != TFS_ERR_OK) {
+      goto out;
+    }
+  }
+#endif
+
   current_dir_blk = TFS_ROOT_DIR_BLK;
   loaded_dir_blk = 0;
 out:
+  mount_error = tfs_last_error;
   drive_deselect();
 }
 
 #ifdef TFS_ENABLE_FORMAT
 void tfs_format(void) {
   uint32_t pos;
-  uint8_t mask, last;
-  uint16_t offset;
 #ifdef TFS_FORMAT_STATE_CALLBACK
   uint32_t prog_max = last_bitmap_blk >> TFS_BITMAP_BLK_SHIFT;
 #endif
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  // a volume refused by tfs_init may be formatted, a missing device not
+  if (mount_error == TFS_ERR_NO_DEV) {
+    tfs_last_error = TFS_ERR_NO_DEV;
     return;
   }
 
@@ -415,49 +2995,52 @@ void tfs_format(void) {
 
   drive_select();
 
-  // write the bitmap-blocks
-  // first block always in use (the bitmapblock itself)
-  memset(&bitmap_blk, 0, TFS_BLOCKSIZE);
-  bitmap_blk[0] = 1;
-  pos = TFS_FIRST_BITMAP_BLK;
-  last = 0;
-#ifdef TFS_FORMAT_STATE_CALLBACK
-  tfs_format_state(TFS_FORMAT_STATE_BITMAP_START);
+  // used blocks are counted again on next request
+  used_blocks = TFS_USED_INVAL;
+  bitmap_dirty = 0;
+#ifdef TFS_BITMAP_SUMMARY
+  memset(bitmap_full, 0, sizeof(bitmap_full));
+#endif
+#ifdef TFS_FREE_EXTENTS
+  ext_state = TFS_EXT_INVAL;
 #endif
-  while(1) {
+
 #ifdef TFS_FORMAT_STATE_CALLBACK
-    // print progress
-    tfs_format_progress(pos >> TFS_BITMAP_BLK_SHIFT, prog_max);
+  tfs_format_state(TFS_FORMAT_STATE_BITMAP_START);
+  tfs_format_progress(0, prog_max);
 #endif
 
-    if (pos == last_bitmap_blk) {
-      last = 1;
-      // mark all blocks after end of disk as used
-      mask = 0xff << (last_bitmap_len & 0x07);
-      offset = last_bitmap_len >> 3;
-      bitmap_blk[offset] |= mask;
-      for (offset++; offset < TFS_BLOCKSIZE; offset++) {
-        bitmap_blk[offset] = 0xff;
-      }
-    }
+  // write the first bitmap-block only, the other groups are
+  // written when the first block of them is allocated
+  super_blk = 0;
+  super.magic = TFS_SUPER_MAGIC;
+  super.bitmap_hwm = 1;
+  super.reclaim = 0;
+  super.version = TFS_SUPER_VERSION;
+  super.flags = TFS_SUPER_CLEAN;
+  super.features = TFS_FEATURES;
+  super.used = TFS_USED_INVAL;
+  super.cursor = TFS_FIRST_BITMAP_BLK;
+#ifdef TFS_BITMAP_RESIDENT
+  bitmap_blk = bitmap_buf;
+#endif
+  init_bitmap(bitmap_blk, TFS_FIRST_BITMAP_BLK);
+  write_block(TFS_FIRST_BITMAP_BLK, bitmap_blk);
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
 
-    // write block
-    drive_write_block(pos, bitmap_blk);
-    if (tfs_last_error != TFS_ERR_OK) {
-      goto out;
-    }
+#ifdef TFS_BITMAP_RESIDENT
+  read_bitmaps();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+#endif
 
-    // break on last block
-    if (last) {
 #ifdef TFS_FORMAT_STATE_CALLBACK
-      tfs_format_state(TFS_FORMAT_STATE_BITMAP_DONE);
+  tfs_format_progress(prog_max, prog_max);
+  tfs_format_state(TFS_FORMAT_STATE_BITMAP_DONE);
 #endif
-      break;
-    }
-
-    // skip to next block
-    pos += TFS_BITMAP_BLK_COUNT;
-  };
 
   // read the first bitmap-block
   load_bitmap(TFS_FIRST_BITMAP_BLK);
@@ -469,46 +3052,125 @@ void tfs_format(void) {
   tfs_format_state(TFS_FORMAT_STATE_ROOTDIR);
 #endif
 
-  // alloc root dir block (should be block 3)
-  pos = alloc_block();
+  // alloc root dir block (should be block 1) and superblock
+  pos = alloc_block(0);
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+  super_blk = alloc_block(0);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
-  // init root directory
+  // init root directory, its parent points to the superblock
+  buf_blk = 0;
   memset(blk_buf.raw, 0, TFS_BLOCKSIZE);
+  blk_buf.dir.parent = super_blk;
 
   // write block
-  drive_write_block(pos, blk_buf.raw);
+  store_buf(pos);
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
+  write_super(blk_buf.raw);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
+  sync_bitmap();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
+#ifdef TFS_BITMAP_RESIDENT
+  flush_bitmaps();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+#endif
+
   current_dir_blk = TFS_ROOT_DIR_BLK;
   loaded_dir_blk = 0;
 
+#ifdef TFS_CACHE_BLOCKS
+  cache_flush();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+#endif
+
 #ifdef TFS_FORMAT_STATE_CALLBACK
   tfs_format_state(TFS_FORMAT_STATE_DONE);
 #endif
 
 out:
+  // the volume is usable after a complete format only
+  mount_error = tfs_last_error;
   drive_deselect();
 }
 #endif
 
+void tfs_flush(void) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
+    return;
+  }
+
+  tfs_last_error = TFS_ERR_OK;
+  drive_select();
+
+#ifdef TFS_BITMAP_RESIDENT
+  // write back modified bitmap blocks
+  flush_bitmaps();
+#endif
+
+#ifdef TFS_CACHE_BLOCKS
+  // write back all dirty blocks
+  if (tfs_last_error == TFS_ERR_OK) {
+    cache_flush();
+  }
+#endif
+
+  // record the allocation state, the bitmap is on disk now
+  if (tfs_last_error == TFS_ERR_OK) {
+    mark_clean();
+  }
+
+  drive_deselect();
+}
+
 uint32_t tfs_get_used(void) {
-  uint32_t pos, used;
-  uint16_t i;
-  uint8_t *p;
-  uint8_t mask;
+  uint32_t pos, used, cursor;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return 0;
   }
 
   tfs_last_error = TFS_ERR_OK;
+
+  // already counted?
+  if (used_blocks != TFS_USED_INVAL) {
+    return used_blocks;
+  }
+
   drive_select();
 
+#ifdef TFS_FREE_EXTENTS
+  // building the free extent index counts the used blocks
+  if (ext_ready() || tfs_last_error != TFS_ERR_OK) {
+    drive_deselect();
+    return (tfs_last_error == TFS_ERR_OK) ? used_blocks : 0;
+  }
+#endif
+
+  // allocation continues in the group loaded before
+  cursor = loaded_bitmap_blk;
+  if (cursor == TFS_BITMAP_BLK_INVAL) {
+    cursor = TFS_FIRST_BITMAP_BLK;
+  }
+
   pos = TFS_FIRST_BITMAP_BLK;
   used = 0;
   while (1) {
@@ -520,22 +3182,15 @@ uint32_t tfs_get_used(void) {
     }
 
     // count allocated blocks
-    for (i = 0, p = bitmap_blk; i < TFS_BLOCKSIZE; i++, p++) {
-      if (*p > 0) {
-        for (mask = 1; mask != 0; mask <<= 1) {
-          if ((*p & mask) != 0) {
-            used++;
-          }
-        }
-      }
-    }
+    used += count_used_bits(bitmap_blk);
 
     // check for end of list
     if (pos == last_bitmap_blk) {
-      load_bitmap(TFS_FIRST_BITMAP_BLK);
+      load_bitmap(cursor);
       drive_deselect();
       // blocks after dist end are marked as use, so substract them
-      return used - (TFS_BITMAP_BLK_COUNT - last_bitmap_len);
+      used_blocks = used - (TFS_BITMAP_BLK_COUNT - last_bitmap_len);
+      return used_blocks;
     }
 
     // next block
@@ -551,9 +3206,11 @@ uint8_t tfs_read_dir(void) {
   uint32_t pos = current_dir_blk;
   uint8_t i;
   uint8_t done = 0;
-  TFS_DIR_ITEM *p;
+  const TFS_BLK_BUFFER *blk;
+  const TFS_DIR_ITEM *p;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return 0;
   }
 
@@ -562,13 +3219,14 @@ uint8_t tfs_read_dir(void) {
 
   while (1) {
     // read current directory block
-    drive_read_block(pos, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
+    blk = map_block(pos);
+    if (blk == NULL) {
       goto out;
     }
+    PREFETCH_CHAIN(blk->dir.next, 1);
 
     // iterrate items
-    for (i = 0, p = blk_buf.dir.items; i < TFS_DIR_BLK_ITEMS; i++, p++) {
+    for (i = 0, p = blk->dir.items; i < TFS_DIR_BLK_ITEMS; i++, p++) {
 #ifdef TFS_READ_DIR_USERDATA
       if (!tfs_dir_handler(data, p)) {
 #else
@@ -579,7 +3237,7 @@ uint8_t tfs_read_dir(void) {
     }
 
     // go to next block in chain
-    pos = blk_buf.dir.next;
+    pos = blk->dir.next;
     if (pos == 0) {
       done = 1;
       break;
@@ -595,19 +3253,21 @@ void tfs_change_dir_root(void) {
 }
 
 void tfs_change_dir_parent(void) {
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return;
   }
 
   tfs_last_error = TFS_ERR_OK;
   drive_select();
 
-  drive_read_block(current_dir_blk, blk_buf.raw);
+  load_buf(current_dir_blk);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
-  if (blk_buf.dir.parent == 0) {
+  // parent of the root directory points to the superblock
+  if (current_dir_blk == TFS_ROOT_DIR_BLK || blk_buf.dir.parent == 0) {
     tfs_last_error = TFS_ERR_NOT_EXIST;
     goto out;
   }
@@ -619,9 +3279,10 @@ out:
 }
 
 void tfs_change_dir(const char *name) {
-  TFS_DIR_ITEM *item;
+  const TFS_DIR_ITEM *item;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return;
   }
 
@@ -629,7 +3290,7 @@ void tfs_change_dir(const char *name) {
   drive_select();
 
   // search for dir name
-  item = find_file(name, 0);
+  item = lookup_file(name);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
@@ -650,13 +3311,19 @@ void tfs_create_dir(const char *name) {
   TFS_DIR_ITEM *item;
   uint32_t new;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return;
   }
 
   tfs_last_error = TFS_ERR_OK;
   drive_select();
 
+  begin_alloc();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
   // check for name
   item = find_file(name, 1);
   if (tfs_last_error != TFS_ERR_OK) {
@@ -669,44 +3336,58 @@ void tfs_create_dir(const char *name) {
     goto out;
   }
 
-  // alloc new dir block
-  new = alloc_block();
+  // alloc new dir block near its parent
+  new = alloc_block(loaded_dir_blk + 1);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
   // update item
+  buf_blk = 0;
   item->type = TFS_DIR_ITEM_DIR;
   item->blk = new;
   item->size = 0;
   strncpy(item->name, name, TFS_NAME_LEN);
-  drive_write_block(loaded_dir_blk, blk_buf.raw);
+  store_buf(loaded_dir_blk);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
   // init sub directory
+  buf_blk = 0;
   memset(blk_buf.raw, 0, TFS_BLOCKSIZE);
   blk_buf.dir.parent = current_dir_blk;
 
   // write block
-  drive_write_block(new, blk_buf.raw);
+  store_buf(new);
 out:
+  finish_alloc();
   drive_deselect();
 }
 
 void tfs_write_file(const char *name, const uint8_t *data, uint32_t len, uint8_t overwrite) {
   TFS_DIR_ITEM *item;
   uint32_t pos;
-  uint16_t blk_len;
+#ifdef TFS_EXTENT_FILES
+  uint8_t err = TFS_ERR_OK;
+#else
+  uint32_t prev;
+  uint32_t blk_cnt;
+#endif
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return;
   }
 
   tfs_last_error = TFS_ERR_OK;
   drive_select();
 
+  begin_alloc();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
   // check for name
   item = find_file(name, 1);
   if (tfs_last_error != TFS_ERR_OK) {
@@ -715,7 +3396,7 @@ void tfs_write_file(const char *name, const uint8_t *data, uint32_t len, uint8_t
 
   // file already exists?
   if (item->type != TFS_DIR_ITEM_FREE) {
-    if (!overwrite || item->type != TFS_DIR_ITEM_FILE) {
+    if (!overwrite || !FILE_ITEM(item->type)) {
       tfs_last_error = TFS_ERR_FILE_EXIST;
       goto out;
     }
@@ -729,81 +3410,119 @@ void tfs_write_file(const char *name, const uint8_t *data, uint32_t len, uint8_t
 #endif
 
     // free old data blocks
+#ifdef TFS_EXTENT_FILES
+    if (item->type & TFS_DIR_ITEM_EXTENTS) {
+      ext_file_free(item->blk, 0);
+    } else
+#endif
     free_file_blocks(item->blk);
     if (tfs_last_error != TFS_ERR_OK) {
       goto out;
     }
 
     // re-read directory block (buffer got overwritten by free_file_blocks)
-    drive_read_block(loaded_dir_blk, blk_buf.raw);
+    load_buf(loaded_dir_blk);
     if (tfs_last_error != TFS_ERR_OK) {
       goto out;
     }
   }
 
+#ifdef TFS_EXTENT_FILES
+  // allocate map and data blocks, the file is stored as extent map
+  pos = 0;
+  if (len > 0) {
+    reserve_blocks(TFS_EXT_DATA_BLOCKS(len) + 1);
+    ext_file_extend(&pos, TFS_EXT_DATA_BLOCKS(len), loaded_dir_blk + 1);
+    if (tfs_last_error != TFS_ERR_OK) {
+      // drop the blocks got so far, an overwritten file is left empty
+      err = tfs_last_error;
+      tfs_last_error = TFS_ERR_OK;
+      ext_file_free(pos, 0);
+      if (tfs_last_error != TFS_ERR_OK) {
+        goto out;
+      }
+      pos = 0;
+      len = 0;
+    }
+
+    // re-read directory block
+    load_buf(loaded_dir_blk);
+    if (tfs_last_error != TFS_ERR_OK) {
+      goto out;
+    }
+    if (err != TFS_ERR_OK && item->type == TFS_DIR_ITEM_FREE) {
+      goto out;
+    }
+  }
+#else
   if (len == 0) {
     // clear block pointer in case of overwrite
     pos = 0;
   } else {
-    // allocate first data block
-    pos = alloc_block();
+    // allocate first data block, all blocks of the file are
+    // taken from contiguous runs
+    reserve_blocks(TFS_DATA_BLOCKS(len));
+    pos = alloc_block(loaded_dir_blk + 1);
     if (tfs_last_error != TFS_ERR_OK) {
       goto out;
     }
   }
+#endif
 
   // update item
-  item->type = TFS_DIR_ITEM_FILE;
+  buf_blk = 0;
+  item->type = TFS_NEW_FILE_TYPE;
   item->blk = pos;
   item->size = len;
   strncpy(item->name, name, TFS_NAME_LEN);
-  drive_write_block(loaded_dir_blk, blk_buf.raw);
+  store_buf(loaded_dir_blk);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
-  // write data blocks
-  blk_buf.data.prev = 0;
-  while (pos != 0) {
-    // calculate block length and update remaining length
-    if (len > TFS_DATA_LEN) {
-      blk_len = TFS_DATA_LEN;
-      len -= TFS_DATA_LEN;
-
-      // allocate next data block
-      blk_buf.data.next = alloc_block();
-      // if error -> try to write the last data block, error is handled after write
-    } else {
-      blk_len = len;
-      len = 0;
-      blk_buf.data.next = 0;
-    }
-
-    // copy user data
-    memcpy(blk_buf.data.data, data, blk_len);
-    data += blk_len;
+  if (len == 0) {
+    goto out;
+  }
 
-    // write block
-    drive_write_block(pos, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
-      goto out;
-    }
+#ifdef TFS_EXTENT_FILES
+  ext_file_write(pos, data, len, 0, 0);
+out:
+  if (tfs_last_error == TFS_ERR_OK) {
+    tfs_last_error = err;
+  }
+#else
 
-    blk_buf.data.prev = pos;
-    pos = blk_buf.data.next;
+  // write all data blocks followed by another one
+  prev = 0;
+  blk_cnt = (len - 1) / TFS_DATA_LEN;
+  pos = write_data_blocks(pos, &prev, data, blk_cnt);
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
   }
+  data += blk_cnt * TFS_DATA_LEN;
+  len -= blk_cnt * TFS_DATA_LEN;
+
+  // write last data block
+  buf_blk = 0;
+  blk_buf.data.prev = prev;
+  blk_buf.data.next = 0;
+  memcpy(blk_buf.data.data, data, len);
+  store_buf(pos);
 out:
+#endif
+  finish_alloc();
   drive_deselect();
 }
 
 uint32_t tfs_read_file(const char *name, uint8_t *data, uint32_t max_len) {
-  TFS_DIR_ITEM *item;
+  const TFS_DIR_ITEM *item;
   uint32_t pos;
   uint32_t len = 0;
   uint32_t rem;
-  uint16_t blk_len;
+  uint32_t blk_cnt;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return 0;
   }
 
@@ -811,13 +3530,13 @@ uint32_t tfs_read_file(const char *name, uint8_t *data, uint32_t max_len) {
   drive_select();
 
   // search for file
-  item = find_file(name, 0);
+  item = lookup_file(name);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
   // file not found?
-  if (item == NULL || item->type != TFS_DIR_ITEM_FILE) {
+  if (item == NULL || !FILE_ITEM(item->type)) {
     tfs_last_error = TFS_ERR_NOT_EXIST;
     goto out;
   }
@@ -829,37 +3548,36 @@ uint32_t tfs_read_file(const char *name, uint8_t *data, uint32_t max_len) {
     len = max_len;
   }
 
+#ifdef TFS_EXTENT_FILES
+  if (item->type & TFS_DIR_ITEM_EXTENTS) {
+    len = ext_file_read(pos, data, len, 0);
+    goto out;
+  }
+#endif
+
   rem = len;
-  while (1) {
-    // read next data block
-    drive_read_block(pos, blk_buf.raw);
+
+  // read full data blocks directly to user buffer
+  blk_cnt = rem / TFS_DATA_LEN;
+  if (blk_cnt > 0) {
+    read_data_blocks(pos, data, blk_cnt);
     if (tfs_last_error != TFS_ERR_OK) {
       goto out;
     }
 
-    // calculate block length and update remaining length
-    if (rem > TFS_DATA_LEN) {
-      blk_len = TFS_DATA_LEN;
-      rem -= TFS_DATA_LEN;
-    } else {
-      blk_len = rem;
-      rem = 0;
-    }
-
-    // copy user data
-    memcpy(data, blk_buf.data.data, blk_len);
-    data += blk_len;
-
-    // go to next data block
     pos = blk_buf.data.next;
-    if (pos == 0) {
-      if (rem > 0) {
-        tfs_last_error = TFS_ERR_UNEXP_EOF;
-        goto out;
-      }
+    data += blk_cnt * TFS_DATA_LEN;
+    rem -= blk_cnt * TFS_DATA_LEN;
+  }
 
+  // read remaining partial block
+  if (rem > 0) {
+    if (pos == 0) {
+      tfs_last_error = TFS_ERR_UNEXP_EOF;
       goto out;
     }
+
+    read_data_part(pos, data, 0, rem);
   }
 out:
   drive_deselect();
@@ -876,13 +3594,19 @@ void tfs_delete(const char *name) {
   uint8_t i;
   TFS_DIR_ITEM *p;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return;
   }
 
   tfs_last_error = TFS_ERR_OK;
   drive_select();
 
+  begin_alloc();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
   // search for name
   item = find_file(name, 0);
   if (tfs_last_error != TFS_ERR_OK) {
@@ -897,7 +3621,7 @@ void tfs_delete(const char *name) {
 
 #ifdef TFS_EXTENDED_API
   // check file type
-  if (type != 0 && item->type != type) {
+  if (type != 0 && TFS_DIR_ITEM_TYPE(item->type) != type) {
     tfs_last_error = TFS_ERR_NOT_EXIST;
     goto out;
   }
@@ -913,8 +3637,10 @@ void tfs_delete(const char *name) {
   pos = item->blk;
 
   // delete file
-  if (item->type == TFS_DIR_ITEM_FILE) {
+  if (FILE_ITEM(item->type)) {
     // update item
+    i = item->type;
+    buf_blk = 0;
     item->type = TFS_DIR_ITEM_FREE;
     write_dir_cleanup();
     if (tfs_last_error != TFS_ERR_OK) {
@@ -922,6 +3648,12 @@ void tfs_delete(const char *name) {
     }
 
     // free data blocks
+#ifdef TFS_EXTENT_FILES
+    if (i & TFS_DIR_ITEM_EXTENTS) {
+      ext_file_free(pos, 0);
+      goto out;
+    }
+#endif
     free_file_blocks(pos);
     goto out;
   }
@@ -929,7 +3661,7 @@ void tfs_delete(const char *name) {
   // delete directory
   if (item->type == TFS_DIR_ITEM_DIR) {
     // read sub directory block
-    drive_read_block(pos, blk_buf.raw);
+    load_buf(pos);
     if (tfs_last_error != TFS_ERR_OK) {
       goto out;
     }
@@ -947,12 +3679,13 @@ void tfs_delete(const char *name) {
     }
 
     // re-read parent directory block
-    drive_read_block(loaded_dir_blk, blk_buf.raw);
+    load_buf(loaded_dir_blk);
     if (tfs_last_error != TFS_ERR_OK) {
       goto out;
     }
 
     // update item
+    buf_blk = 0;
     item->type = TFS_DIR_ITEM_FREE;
     write_dir_cleanup();
     if (tfs_last_error != TFS_ERR_OK) {
@@ -966,13 +3699,15 @@ void tfs_delete(const char *name) {
 
   tfs_last_error = TFS_ERR_NOT_EXIST;
 out:
+  finish_alloc();
   drive_deselect();
 }
 
 void tfs_rename(const char *from, const char *to) {
   TFS_DIR_ITEM *item;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return;
   }
 
@@ -980,14 +3715,11 @@ void tfs_rename(const char *from, const char *to) {
   drive_select();
 
   // check if 'to name' already exists
-  item = find_file(to, 0);
-  if (tfs_last_error != TFS_ERR_OK) {
+  if (lookup_file(to) != NULL) {
+    tfs_last_error = TFS_ERR_FILE_EXIST;
     goto out;
   }
-
-  // file already exists?
-  if (item != NULL) {
-    tfs_last_error = TFS_ERR_FILE_EXIST;
+  if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
@@ -1004,8 +3736,9 @@ void tfs_rename(const char *from, const char *to) {
   }
 
   // update item
+  buf_blk = 0;
   strncpy(item->name, to, TFS_NAME_LEN);
-  drive_write_block(loaded_dir_blk, blk_buf.raw);
+  store_buf(loaded_dir_blk);
 
 out:
   drive_deselect();
@@ -1033,18 +3766,35 @@ static void init_pos(TFS_FILEHANDLE *hnd) {
 
 static void update_dir_item(TFS_FILEHANDLE *hnd) {
   // read file's directory block
-  drive_read_block(hnd->dir_blk, blk_buf.raw);
+  load_buf(hnd->dir_blk);
   if (tfs_last_error != TFS_ERR_OK) {
     return;
   }
 
   // update item
+  buf_blk = 0;
   hnd->dir_item->blk = hnd->first_blk;
   hnd->dir_item->size = hnd->size;
-  drive_write_block(hnd->dir_blk, blk_buf.raw);
+  store_buf(hnd->dir_blk);
+}
+
+#ifdef TFS_EXTENT_FILES
+static void ext_update_item(TFS_FILEHANDLE *hnd) {
+  uint8_t err;
+
+  // updates the directory item of an extent file, even after an error,
+  // so that a new map block and the blocks in it are not lost
+  err = tfs_last_error;
+  tfs_last_error = TFS_ERR_OK;
+  update_dir_item(hnd);
+  if (tfs_last_error == TFS_ERR_OK) {
+    tfs_last_error = err;
+  }
 }
+#endif
 
 static uint8_t seek(TFS_FILEHANDLE *hnd, uint32_t pos, uint8_t append) {
+  const TFS_BLK_BUFFER *blk = NULL;
   uint32_t last_blk = 0;
   uint32_t last_pos = 0;
 
@@ -1052,45 +3802,58 @@ static uint8_t seek(TFS_FILEHANDLE *hnd, uint32_t pos, uint8_t append) {
   if (pos == 0 || hnd->curr_blk == 0) {
     init_pos(hnd);
   }
+  tail_start(hnd, pos);
+#ifdef TFS_SEEK_INDEX
+  seek_index_start(hnd, pos);
+#endif
 
   // seek backward, till we are in requested block
   while (hnd->curr_blk != 0 && hnd->curr_pos > pos) {
-    drive_read_block(hnd->curr_blk, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
+    blk = map_block(hnd->curr_blk);
+    if (blk == NULL) {
       return SEEK_ERROR;
     }
 
     // fail, if we have no prev block
-    if (blk_buf.data.prev == 0) {
+    if (blk->data.prev == 0) {
       tfs_last_error = TFS_ERR_UNEXP_EOF;
       return SEEK_ERROR;
     }
 
-    hnd->curr_blk = blk_buf.data.prev;
+    hnd->curr_blk = blk->data.prev;
     hnd->curr_pos -= TFS_DATA_LEN;
+    SEEK_INDEX_PUT(hnd);
   }
 
   // seek forward, till we are in requested block
   while (hnd->curr_blk != 0 && (hnd->curr_pos + TFS_DATA_LEN) <= pos) {
-    drive_read_block(hnd->curr_blk, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
+    blk = map_block(hnd->curr_blk);
+    if (blk == NULL) {
       return SEEK_ERROR;
     }
+    PREFETCH_CHAIN(blk->data.next, (pos - hnd->curr_pos) / TFS_DATA_LEN);
 
     // remember last valid block
     last_blk = hnd->curr_blk;
     last_pos = hnd->curr_pos;
 
-    hnd->curr_blk = blk_buf.data.next;
+    hnd->curr_blk = blk->data.next;
     hnd->curr_pos += TFS_DATA_LEN;
+    SEEK_INDEX_PUT(hnd);
   }
 
   if (hnd->curr_blk != 0) {
-    drive_read_block(hnd->curr_blk, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
+    // readers map the current block on their own
+    if (!append) {
+      return SEEK_OK;
+    }
+
+    blk = map_block(hnd->curr_blk);
+    if (blk == NULL) {
       return SEEK_ERROR;
     }
 
+    buffer_block(blk, hnd->curr_blk);
     return SEEK_OK;
   }
 
@@ -1099,15 +3862,22 @@ static uint8_t seek(TFS_FILEHANDLE *hnd, uint32_t pos, uint8_t append) {
     return SEEK_EOF;
   }
 
+  // last block gets modified
+  if (blk != NULL) {
+    buffer_block(blk, last_blk);
+  }
+
   // check for valid first block
   if (hnd->first_blk == 0) {
     // allocate first block
-    hnd->first_blk = alloc_block();
+    hnd->first_blk = alloc_block(hnd->dir_blk + 1);
     if (tfs_last_error != TFS_ERR_OK) {
       return SEEK_ERROR;
     }
 
+    buf_blk = 0;
     memset(blk_buf.raw, 0, TFS_BLOCKSIZE);
+    hnd->tail = 0;
 
     init_pos(hnd);
     last_blk = hnd->curr_blk;
@@ -1118,32 +3888,217 @@ static uint8_t seek(TFS_FILEHANDLE *hnd, uint32_t pos, uint8_t append) {
   hnd->curr_pos = last_pos;
   while ((hnd->curr_pos + TFS_DATA_LEN) <= pos) {
     // allocate next block
-    blk_buf.data.next = alloc_block();
+    buf_blk = 0;
+    blk_buf.data.next = alloc_block(hnd->curr_blk + 1);
     // if error -> try to write the last data block, error is handled after write
 
     // update pointer
-    drive_write_block(hnd->curr_blk, blk_buf.raw);
+    store_buf(hnd->curr_blk);
     if (tfs_last_error != TFS_ERR_OK) {
       return SEEK_ERROR;
     }
 
     // next block data must be initialized with zeros
+    buf_blk = 0;
     memset(blk_buf.data.data, 0, TFS_DATA_LEN);
 
     blk_buf.data.prev = hnd->curr_blk;
     hnd->curr_blk = blk_buf.data.next;
     blk_buf.data.next = 0;
     hnd->curr_pos += TFS_DATA_LEN;
+    SEEK_INDEX_PUT(hnd);
   }
 
   // caller must write the current datablock and call update_dir_item
   return SEEK_APPEND;
 }
 
+static uint8_t load_tail(TFS_FILEHANDLE *hnd) {
+  const TFS_BLK_BUFFER *blk;
+
+  // reads the tail pointer from the first block once, returns 0 on errors
+  if (hnd->tail == TFS_TAIL_INVAL) {
+    blk = map_block(hnd->first_blk);
+    if (blk == NULL) {
+      return 0;
+    }
+    hnd->tail = blk->data.prev;
+  }
+
+  return 1;
+}
+
+static void tail_start(TFS_FILEHANDLE *hnd, uint32_t pos) {
+  const TFS_BLK_BUFFER *blk;
+  uint32_t tail_pos;
+
+  // moves the handle to the block holding the file end, if 'pos' is in or behind it,
+  // only volumes marked by TFS_FEAT_TAIL are known to keep the pointer up to date
+  if (hnd->first_blk == 0 || hnd->size == 0 || (super.features & TFS_FEAT_TAIL) == 0) {
+    return;
+  }
+
+  tail_pos = (hnd->size - 1) - ((hnd->size - 1) % TFS_DATA_LEN);
+  if (pos < tail_pos || (hnd->curr_blk != 0 && hnd->curr_pos >= tail_pos)) {
+    return;
+  }
+
+  if (!load_tail(hnd) || hnd->tail == 0) {
+    return;
+  }
+
+  // the chain has to end there (a writer not knowing the pointer leaves it behind)
+  blk = map_block(hnd->tail);
+  if (blk == NULL || blk->data.next != 0) {
+    return;
+  }
+
+  hnd->curr_blk = hnd->tail;
+  hnd->curr_pos = tail_pos;
+}
+
+static void update_tail(TFS_FILEHANDLE *hnd) {
+  const TFS_BLK_BUFFER *blk;
+  uint32_t tail = 0;
+
+  // stores the current block as tail in the prev pointer of the first block,
+  // if it holds the file end and ends the chain, 0 otherwise
+  if (hnd->first_blk == 0 || (super.features & TFS_FEAT_TAIL) == 0) {
+    return;
+  }
+
+  if (hnd->curr_blk != 0 && hnd->curr_pos < hnd->size && hnd->size - hnd->curr_pos <= TFS_DATA_LEN) {
+    blk = map_block(hnd->curr_blk);
+    if (blk == NULL) {
+      return;
+    }
+    if (blk->data.next == 0) {
+      tail = hnd->curr_blk;
+    }
+  }
+
+  // write the first block only if the pointer changes
+  if (!load_tail(hnd) || hnd->tail == tail) {
+    return;
+  }
+
+  load_buf(hnd->first_blk);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+
+  buf_blk = 0;
+  blk_buf.data.prev = tail;
+  store_buf(hnd->first_blk);
+  if (tfs_last_error != TFS_ERR_OK) {
+    return;
+  }
+
+  hnd->tail = tail;
+}
+
+#ifdef TFS_SEEK_INDEX
+static void seek_index_put(TFS_FILEHANDLE *hnd) {
+  uint32_t idx;
+  uint16_t k;
+
+  // records the current block, if it is at a checkpoint position
+  idx = hnd->curr_pos / TFS_DATA_LEN;
+  if (hnd->curr_blk == 0 || idx == 0) {
+    return;
+  }
+
+  // double the checkpoint distance, till the table covers the position
+  while ((idx >> hnd->seek_shift) >= TFS_SEEK_INDEX) {
+    for (k = 1; k < TFS_SEEK_INDEX; k++) {
+      hnd->seek_index[k] = (2 * (uint32_t) k < TFS_SEEK_INDEX) ? hnd->seek_index[2 * k] : 0;
+    }
+    hnd->seek_shift++;
+  }
+
+  if ((idx & ((1UL << hnd->seek_shift) - 1)) == 0) {
+    hnd->seek_index[idx >> hnd->seek_shift] = hnd->curr_blk;
+  }
+}
+
+static void seek_index_start(TFS_FILEHANDLE *hnd, uint32_t pos) {
+  uint32_t idx, curr, dist;
+  uint16_t k;
+
+  // moves the handle to the nearest known checkpoint in front of 'pos',
+  // if less blocks have to be walked from there than from the current position
+  idx = pos / TFS_DATA_LEN;
+  k = TFS_SEEK_INDEX - 1;
+  if ((idx >> hnd->seek_shift) < TFS_SEEK_INDEX) {
+    k = idx >> hnd->seek_shift;
+  }
+  while (k > 0 && hnd->seek_index[k] == 0) {
+    k--;
+  }
+  if (k == 0) {
+    return;
+  }
+
+  dist = idx - ((uint32_t) k << hnd->seek_shift);
+  curr = hnd->curr_pos / TFS_DATA_LEN;
+  if (hnd->curr_blk != 0 && (curr > idx ? curr - idx : idx - curr) <= dist) {
+    return;
+  }
+
+  hnd->curr_blk = hnd->seek_index[k];
+  hnd->curr_pos = ((uint32_t) k << hnd->seek_shift) * TFS_DATA_LEN;
+}
+
+static void seek_index_cut(TFS_FILEHANDLE *hnd) {
+  uint32_t idx;
+  uint16_t k;
+
+  // forgets the checkpoints behind the current block, the chain ends there
+  idx = hnd->curr_pos / TFS_DATA_LEN;
+  for (k = 1; k < TFS_SEEK_INDEX; k++) {
+    if (((uint32_t) k << hnd->seek_shift) > idx) {
+      hnd->seek_index[k] = 0;
+    }
+  }
+}
+#endif
+
+static void clear_file_end(TFS_FILEHANDLE *hnd) {
+  uint32_t blk_os;
+
+#ifdef TFS_EXTENT_FILES
+  // old data behind the file end must read as zeros
+  if (hnd->extents) {
+    blk_os = hnd->size & (TFS_BLOCKSIZE - 1);
+    if (blk_os != 0) {
+      ext_file_write(hnd->first_blk, NULL, TFS_BLOCKSIZE - blk_os, hnd->size, TFS_EXT_DATA_BLOCKS(hnd->size));
+    }
+    return;
+  }
+#endif
+
+  // last block completely used?
+  blk_os = hnd->size % TFS_DATA_LEN;
+  if (blk_os == 0) {
+    return;
+  }
+
+  // the block holding the file end is part of the chain
+  if (seek(hnd, hnd->size, 1) != SEEK_OK) {
+    return;
+  }
+
+  // old data behind the file end must read as zeros
+  buf_blk = 0;
+  memset(blk_buf.data.data + blk_os, 0, TFS_DATA_LEN - blk_os);
+  store_buf(hnd->curr_blk);
+}
+
 TFS_DIR_ITEM *tfs_stat(const char *name) {
   TFS_DIR_ITEM *item;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return NULL;
   }
 
@@ -1159,13 +4114,19 @@ TFS_DIR_ITEM *tfs_stat(const char *name) {
 void tfs_touch(const char *name) {
   TFS_DIR_ITEM *item;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return;
   }
 
   tfs_last_error = TFS_ERR_OK;
   drive_select();
 
+  begin_alloc();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
   // check for name
   item = find_file(name, 1);
   if (tfs_last_error != TFS_ERR_OK) {
@@ -1178,16 +4139,18 @@ void tfs_touch(const char *name) {
   }
 
   // update item
-  item->type = TFS_DIR_ITEM_FILE;
+  buf_blk = 0;
+  item->type = TFS_NEW_FILE_TYPE;
   item->blk = 0;
   item->size = 0;
   strncpy(item->name, name, TFS_NAME_LEN);
-  drive_write_block(loaded_dir_blk, blk_buf.raw);
+  store_buf(loaded_dir_blk);
   if (tfs_last_error != TFS_ERR_OK) {
     goto out;
   }
 
 out:
+  finish_alloc();
   drive_deselect();
 }
 
@@ -1196,7 +4159,8 @@ int8_t tfs_open(const char *name) {
   TFS_DIR_ITEM *item;
   int8_t fd = -1;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return -1;
   }
 
@@ -1210,7 +4174,7 @@ int8_t tfs_open(const char *name) {
   }
 
   // file not found?
-  if (item == NULL || item->type != TFS_DIR_ITEM_FILE) {
+  if (item == NULL || !FILE_ITEM(item->type)) {
     tfs_last_error = TFS_ERR_NOT_EXIST;
     goto out;
   }
@@ -1238,6 +4202,14 @@ int8_t tfs_open(const char *name) {
   hnd->dir_item = item;
   hnd->size = item->size;
   hnd->first_blk = item->blk;
+  hnd->tail = TFS_TAIL_INVAL;
+#ifdef TFS_EXTENT_FILES
+  hnd->extents = (item->type & TFS_DIR_ITEM_EXTENTS) != 0;
+#endif
+#ifdef TFS_SEEK_INDEX
+  memset(hnd->seek_index, 0, sizeof(hnd->seek_index));
+  hnd->seek_shift = 0;
+#endif
   init_pos(hnd);
 
 out:
@@ -1248,7 +4220,8 @@ out:
 void tfs_close(int8_t fd) {
   TFS_FILEHANDLE *hnd;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return;
   }
 
@@ -1275,8 +4248,12 @@ void tfs_trunc(int8_t fd, uint32_t size) {
   TFS_FILEHANDLE *hnd;
   uint8_t seek_res;
   uint32_t free_from = 0;
+#ifdef TFS_EXTENT_FILES
+  uint32_t old;
+#endif
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return;
   }
 
@@ -1296,6 +4273,43 @@ void tfs_trunc(int8_t fd, uint32_t size) {
     goto out;
   }
 
+  begin_alloc();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
+#ifdef TFS_EXTENT_FILES
+  if (hnd->extents) {
+    if (size > hnd->size) {
+      // expand file, new blocks are zeroed
+      clear_file_end(hnd);
+      if (tfs_last_error != TFS_ERR_OK) {
+        goto out;
+      }
+      reserve_blocks(TFS_EXT_DATA_BLOCKS(size) - TFS_EXT_DATA_BLOCKS(hnd->size) + (hnd->first_blk == 0));
+      ext_file_extend(&hnd->first_blk, TFS_EXT_DATA_BLOCKS(size), hnd->dir_blk + 1);
+
+      // blocks behind the old end hold no data, reserved ones are not zeroed yet
+      old = TFS_EXT_DATA_BLOCKS(hnd->size);
+      if (tfs_last_error == TFS_ERR_OK && size > old << TFS_BLOCKSIZE_WIDTH) {
+        ext_file_write(hnd->first_blk, NULL, size - (old << TFS_BLOCKSIZE_WIDTH), old << TFS_BLOCKSIZE_WIDTH, old);
+      }
+    } else {
+      // free remaining blocks, the map too for an empty file
+      ext_file_free(hnd->first_blk, TFS_EXT_DATA_BLOCKS(size));
+      if (size == 0) {
+        hnd->first_blk = 0;
+      }
+    }
+    if (tfs_last_error == TFS_ERR_OK) {
+      hnd->size = size;
+    }
+
+    ext_update_item(hnd);
+    goto out;
+  }
+#endif
+
   if (size == 0) {
     // simple case: free all
     free_file_blocks(hnd->first_blk);
@@ -1304,23 +4318,49 @@ void tfs_trunc(int8_t fd, uint32_t size) {
     }
 
     hnd->first_blk = 0;
+    hnd->tail = 0;
     init_pos(hnd);
+#ifdef TFS_SEEK_INDEX
+    seek_index_cut(hnd);
+#endif
   } else {
     // expand file, if required
-    seek_res = seek(hnd, size, 1);
+    if (size > hnd->size) {
+      clear_file_end(hnd);
+      if (tfs_last_error != TFS_ERR_OK) {
+        goto out;
+      }
+      reserve_blocks(TFS_DATA_BLOCKS(size) - TFS_DATA_BLOCKS(hnd->size));
+    }
+    // go to the block holding the last byte, a block starting
+    // at the new end would keep old data behind it
+    seek_res = seek(hnd, size - 1, 1);
     if (tfs_last_error != TFS_ERR_OK) {
       goto out;
     }
+#ifdef TFS_SEEK_INDEX
+    // checkpoints behind the new end get invalid
+    seek_index_cut(hnd);
+#endif
 
     // check, if we have to free remaining blocks
     if (seek_res == SEEK_OK) {
       free_from = blk_buf.data.next;
+      buf_blk = 0;
       blk_buf.data.next = 0;
     }
 
     // save the last block
     if (seek_res == SEEK_APPEND || free_from != 0) {
-      drive_write_block(hnd->curr_blk, blk_buf.raw);
+      store_buf(hnd->curr_blk);
+      if (tfs_last_error != TFS_ERR_OK) {
+        goto out;
+      }
+    }
+
+    // the tail must not point to a freed block
+    if (free_from != 0) {
+      update_tail(hnd);
       if (tfs_last_error != TFS_ERR_OK) {
         goto out;
       }
@@ -1334,20 +4374,106 @@ void tfs_trunc(int8_t fd, uint32_t size) {
   }
 
   // update directory
+  hnd->size = size;
+  update_dir_item(hnd);
+  if (tfs_last_error == TFS_ERR_OK) {
+    update_tail(hnd);
+  }
+
+out:
+  finish_alloc();
+  drive_deselect();
+}
+
+void tfs_fallocate(int8_t fd, uint32_t len) {
+  TFS_FILEHANDLE *hnd;
+
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
+    return;
+  }
+
+  tfs_last_error = TFS_ERR_OK;
+  drive_select();
+
+  // check fd range
+  if (fd < 0 || fd >= TFS_MAX_FDS) {
+    tfs_last_error = TFS_ERR_INVAL_FD;
+    goto out;
+  }
+
+  // check for valid handle
+  hnd = &handles[fd];
+  if (hnd->usage_count <= 0) {
+    tfs_last_error = TFS_ERR_INVAL_FD;
+    goto out;
+  }
+
+  // nothing to reserve?
+  if (len == 0) {
+    goto out;
+  }
+
+  begin_alloc();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
+#ifdef TFS_EXTENT_FILES
+  if (hnd->extents) {
+    // only the map is extended, the blocks are zeroed when the file grows over them
+    reserve_blocks(TFS_EXT_DATA_BLOCKS(len) + (hnd->first_blk == 0));
+    ext_file_extend(&hnd->first_blk, TFS_EXT_DATA_BLOCKS(len), hnd->dir_blk + 1);
+
+    // map block might be new
+    ext_update_item(hnd);
+    goto out;
+  }
+#endif
+
+  // announce blocks beyond the file end
+  if (len > hnd->size) {
+    reserve_blocks(TFS_DATA_BLOCKS(len) - TFS_DATA_BLOCKS(hnd->size));
+  }
+
+  // extend block chain up to the last byte, file size is kept
+  if (seek(hnd, len - 1, 1) != SEEK_APPEND) {
+    goto out;
+  }
+
+  // save the last block
+  store_buf(hnd->curr_blk);
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
+  // first block might be new
   update_dir_item(hnd);
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
+  // the chain does not end at the file end any more
+  update_tail(hnd);
 
 out:
+  finish_alloc();
   drive_deselect();
 }
 
 uint32_t tfs_write(int8_t fd, const uint8_t *data, uint32_t len, uint32_t offset) {
   TFS_FILEHANDLE *hnd;
   uint32_t blk_os, blk_len;
+  uint32_t blk_cnt, prev;
   uint8_t append = 0;
   uint8_t update_item = 0;
   uint32_t ret = 0;
+#ifdef TFS_EXTENT_FILES
+  uint32_t old;
+#endif
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return 0;
   }
 
@@ -1367,6 +4493,61 @@ uint32_t tfs_write(int8_t fd, const uint8_t *data, uint32_t len, uint32_t offset
     goto out;
   }
 
+  // nothing to write, the file is not extended
+  if (len == 0) {
+    goto out;
+  }
+
+  begin_alloc();
+  if (tfs_last_error != TFS_ERR_OK) {
+    goto out;
+  }
+
+  // gap behind the file end?
+  if (offset > hnd->size) {
+    clear_file_end(hnd);
+    if (tfs_last_error != TFS_ERR_OK) {
+      goto out;
+    }
+  }
+
+#ifdef TFS_EXTENT_FILES
+  if (hnd->extents) {
+    // allocate missing blocks, the map is created with the first one
+    if (offset + len > hnd->size) {
+      reserve_blocks(TFS_EXT_DATA_BLOCKS(offset + len) - TFS_EXT_DATA_BLOCKS(hnd->size) + (hnd->first_blk == 0));
+    }
+    prev = hnd->first_blk;
+    ext_file_extend(&hnd->first_blk, TFS_EXT_DATA_BLOCKS(offset + len), hnd->dir_blk + 1);
+
+    // blocks behind the old end hold no data (reserved ones are not zeroed),
+    // zero the ones in front of the data
+    old = TFS_EXT_DATA_BLOCKS(hnd->size);
+    if (tfs_last_error == TFS_ERR_OK && offset > old << TFS_BLOCKSIZE_WIDTH) {
+      ext_file_write(hnd->first_blk, NULL, offset - (old << TFS_BLOCKSIZE_WIDTH), old << TFS_BLOCKSIZE_WIDTH, old);
+    }
+
+    if (tfs_last_error == TFS_ERR_OK) {
+      ret = ext_file_write(hnd->first_blk, data, len, offset, old);
+      if (offset + ret > hnd->size) {
+        hnd->size = offset + ret;
+        update_item = 1;
+      }
+    }
+
+    // a new map and the written data are recorded in any case
+    if (hnd->first_blk != prev || update_item) {
+      ext_update_item(hnd);
+    }
+    goto out;
+  }
+#endif
+
+  // announce blocks appended to the file
+  if (offset + len > hnd->size) {
+    reserve_blocks(TFS_DATA_BLOCKS(offset + len) - TFS_DATA_BLOCKS(hnd->size));
+  }
+
   // seek to position
   if (seek(hnd, offset, 1) == SEEK_APPEND) {
     append = 1;
@@ -1376,11 +4557,6 @@ uint32_t tfs_write(int8_t fd, const uint8_t *data, uint32_t len, uint32_t offset
     goto out;
   }
 
-  // something to write?
-  if (len == 0) {
-    goto update;
-  }
-
   // write data
   blk_os = offset - hnd->curr_pos;
   blk_len = TFS_DATA_LEN - blk_os;
@@ -1388,6 +4564,7 @@ uint32_t tfs_write(int8_t fd, const uint8_t *data, uint32_t len, uint32_t offset
     if (blk_len > len) {
       blk_len = len;
     }
+    buf_blk = 0;
     memcpy(blk_buf.data.data + blk_os, data, blk_len);
 
     data += blk_len;
@@ -1398,13 +4575,13 @@ uint32_t tfs_write(int8_t fd, const uint8_t *data, uint32_t len, uint32_t offset
     // prealloc next block
     if (len > 0 && blk_buf.data.next == 0) {
       // allocate next block
-      blk_buf.data.next = alloc_block();
+      blk_buf.data.next = alloc_block(hnd->curr_blk + 1);
       // if error -> try to write the last data block, error is handled after write
       append = 1;
     }
 
     // write block
-    drive_write_block(hnd->curr_blk, blk_buf.raw);
+    store_buf(hnd->curr_blk);
     if (tfs_last_error != TFS_ERR_OK) {
       goto out;
     }
@@ -1421,31 +4598,61 @@ uint32_t tfs_write(int8_t fd, const uint8_t *data, uint32_t len, uint32_t offset
 
     // get next block
     if (append) {
-      blk_buf.data.prev = hnd->curr_blk;
+      prev = hnd->curr_blk;
       hnd->curr_blk = blk_buf.data.next;
+      hnd->curr_pos += TFS_DATA_LEN;
+
+      // write all new blocks followed by another one
+      blk_cnt = (len - 1) / TFS_DATA_LEN;
+      if (blk_cnt > 0) {
+        hnd->curr_blk = write_data_blocks(hnd->curr_blk, &prev, data, blk_cnt);
+        if (tfs_last_error != TFS_ERR_OK) {
+          goto out;
+        }
+
+        blk_len = blk_cnt * TFS_DATA_LEN;
+        data += blk_len;
+        len -= blk_len;
+        offset += blk_len;
+        ret += blk_len;
+        hnd->curr_pos += blk_len;
+
+        // update file size
+        if (offset > hnd->size) {
+          hnd->size = offset;
+          update_item = 1;
+        }
+      }
+
+      buf_blk = 0;
+      blk_buf.data.prev = prev;
       blk_buf.data.next = 0;
       memset(blk_buf.data.data, 0, TFS_DATA_LEN);
     } else {
       hnd->curr_blk = blk_buf.data.next;
-      drive_read_block(hnd->curr_blk, blk_buf.raw);
+      hnd->curr_pos += TFS_DATA_LEN;
+      load_buf(hnd->curr_blk);
       if (tfs_last_error != TFS_ERR_OK) {
-        return SEEK_ERROR;
+        goto out;
       }
     }
-    hnd->curr_pos += TFS_DATA_LEN;
+    SEEK_INDEX_PUT(hnd);
 
     // reset start offset
     blk_os = 0;
     blk_len = TFS_DATA_LEN;
   }
 
-update:
   // update directry
   if (update_item) {
     update_dir_item(hnd);
+    if (tfs_last_error == TFS_ERR_OK) {
+      update_tail(hnd);
+    }
   }
 
 out:
+  finish_alloc();
   drive_deselect();
   return ret;
 
@@ -1454,9 +4661,11 @@ out:
 uint32_t tfs_read(int8_t fd, uint8_t *data, uint32_t len, uint32_t offset) {
   TFS_FILEHANDLE *hnd;
   uint32_t blk_os, blk_len;
+  uint32_t blk_cnt, pos;
   uint32_t ret = 0;
 
-  if (tfs_last_error == TFS_ERR_NO_DEV) {
+  if (mount_error != TFS_ERR_OK) {
+    tfs_last_error = mount_error;
     return 0;
   }
 
@@ -1487,6 +4696,13 @@ uint32_t tfs_read(int8_t fd, uint8_t *data, uint32_t len, uint32_t offset) {
     len = blk_len;
   }
 
+#ifdef TFS_EXTENT_FILES
+  if (hnd->extents) {
+    ret = ext_file_read(hnd->first_blk, data, len, offset);
+    goto out;
+  }
+#endif
+
   // seek to position
   if (seek(hnd, offset, 0) == SEEK_EOF) {
     goto out;
@@ -1507,7 +4723,10 @@ uint32_t tfs_read(int8_t fd, uint8_t *data, uint32_t len, uint32_t offset) {
     if (blk_len > len) {
       blk_len = len;
     }
-    memcpy(data, blk_buf.data.data + blk_os, blk_len);
+    read_data_part(hnd->curr_blk, data, blk_os, blk_len);
+    if (tfs_last_error != TFS_ERR_OK) {
+      goto out;
+    }
 
     data += blk_len;
     len -= blk_len;
@@ -1517,24 +4736,45 @@ uint32_t tfs_read(int8_t fd, uint8_t *data, uint32_t len, uint32_t offset) {
       break;
     }
 
+    // read full blocks directly to user buffer
+    blk_cnt = len / TFS_DATA_LEN;
+    if (blk_cnt > 0) {
+      pos = read_data_blocks(blk_buf.data.next, data, blk_cnt);
+      if (tfs_last_error != TFS_ERR_OK) {
+        goto out;
+      }
+
+      hnd->curr_blk = pos;
+      blk_len = blk_cnt * TFS_DATA_LEN;
+      hnd->curr_pos += blk_len;
+      SEEK_INDEX_PUT(hnd);
+      data += blk_len;
+      len -= blk_len;
+      ret += blk_len;
+
+      if (len == 0) {
+        break;
+      }
+    }
+
     // get next block
     hnd->curr_blk = blk_buf.data.next;
     hnd->curr_pos += TFS_DATA_LEN;
     if (hnd->curr_blk == 0) {
       break;
     }
-
-    // read block
-    drive_read_block(hnd->curr_blk, blk_buf.raw);
-    if (tfs_last_error != TFS_ERR_OK) {
-      return SEEK_ERROR;
-    }
+    SEEK_INDEX_PUT(hnd);
 
     // reset start offset
     blk_os = 0;
     blk_len = TFS_DATA_LEN;
   }
 
+  // read ahead for sequential access
+  if (hnd->curr_blk != 0) {
+    PREFETCH_CHAIN(blk_buf.data.next, ret / TFS_DATA_LEN + 1);
+  }
+
 out:
   drive_deselect();
   return ret;
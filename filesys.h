@@ -44,6 +44,7 @@ typedef struct {
 #define TFS_ERR_NO_NAME      7
 #define TFS_ERR_NAME_INVAL   8
 #define TFS_ERR_UNEXP_EOF    9
+#define TFS_ERR_FEATURE      10
 #ifdef TFS_EXTENDED_API
 #define TFS_ERR_NO_FREE_FD  100
 #define TFS_ERR_INVAL_FD    101
@@ -61,6 +62,11 @@ typedef struct {
 #define TFS_DIR_ITEM_DIR  1
 #define TFS_DIR_ITEM_FILE 2
 
+// layout flag of file items, set for files stored as extent map
+// (ports without TFS_EXTENT_FILES do not know these files)
+#define TFS_DIR_ITEM_EXTENTS 0x80
+#define TFS_DIR_ITEM_TYPE(type) ((type) & ~TFS_DIR_ITEM_EXTENTS)
+
 extern TFS_DRIVE_INFO tfs_drive_info;
 extern uint8_t tfs_last_error;
 
@@ -71,6 +77,36 @@ void drive_deselect(void);
 void drive_read_block(uint32_t blkno, uint8_t *data);
 void drive_write_block(uint32_t blkno, const uint8_t *data);
 
+#ifdef TFS_DRIVE_MULTI_BLOCK
+// optional multi block interface, transfers 'count' consecutive blocks
+// the first 'hdr_len' bytes of every block are packed in 'hdr',
+// the remaining bytes of every block are packed in 'data'
+void drive_read_blocks(uint32_t blkno, uint16_t count, uint8_t *hdr, uint16_t hdr_len, uint8_t *data);
+void drive_write_blocks(uint32_t blkno, uint16_t count, const uint8_t *hdr, uint16_t hdr_len, const uint8_t *data);
+#endif
+
+#ifdef TFS_DRIVE_PREFETCH
+// optional read ahead interface, starts reading 'count' consecutive blocks
+// in the background, a following read of these blocks completes the request
+void drive_prefetch_blocks(uint32_t blkno, uint16_t count);
+#endif
+
+#ifdef TFS_DRIVE_MAP_BLOCK
+// optional zero copy interface, returns a read only pointer to the block contents
+// or NULL, if the block can not be mapped (data is read by drive_read_block then)
+const uint8_t *drive_map_block(uint32_t blkno);
+#endif
+
+#ifdef TFS_DRIVE_STREAM
+// optional streaming interface, reads parts of a single block
+// drive_stream_open starts reading block 'blkno', the following calls transfer
+// or skip the next bytes in order, drive_stream_close skips the rest of the block
+void drive_stream_open(uint32_t blkno);
+void drive_stream_read(uint8_t *data, uint16_t len);
+void drive_stream_skip(uint16_t len);
+void drive_stream_close(void);
+#endif
+
 void tfs_init(void);
 
 #ifdef TFS_ENABLE_FORMAT
@@ -90,6 +126,13 @@ void tfs_format_progress(uint32_t pos, uint32_t max);
 
 #endif
 
+#ifdef TFS_CACHE_BLOCKS
+extern uint32_t tfs_cache_hits;
+extern uint32_t tfs_cache_misses;
+#endif
+
+void tfs_flush(void);
+
 uint32_t tfs_get_used(void);
 
 #ifdef TFS_READ_DIR_USERDATA
@@ -122,6 +165,7 @@ void tfs_touch(const char *name);
 int8_t tfs_open(const char *name);
 void tfs_close(int8_t fd);
 void tfs_trunc(int8_t fd, uint32_t size);
+void tfs_fallocate(int8_t fd, uint32_t len);
 uint32_t tfs_write(int8_t fd, const uint8_t *data, uint32_t len, uint32_t offset);
 uint32_t tfs_read(int8_t fd, uint8_t *data, uint32_t len, uint32_t offset);
 #endif
@@ -8,26 +8,371 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <linux/fs.h>
 
+#ifdef TFS_DRIVE_PREFETCH
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// number of blocks in flight, slots are direct mapped by block number
+#define DRIVE_PREFETCH_SLOTS 64
+
+#define SLOT_FREE 0
+#define SLOT_BUSY 1
+#define SLOT_DONE 2
+
+typedef struct {
+  uint8_t state;
+  uint32_t blkno;
+  int32_t res;
+  struct iovec iov;
+  uint8_t data[TFS_BLOCKSIZE];
+} DRIVE_SLOT;
+
+typedef struct {
+  int fd;
+  void *sq_ptr;
+  size_t sq_len;
+  void *cq_ptr;
+  size_t cq_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+} DRIVE_RING;
+
+static DRIVE_RING ring = { .fd = -1 };
+static DRIVE_SLOT slots[DRIVE_PREFETCH_SLOTS];
+
+static int ring_init(void);
+static void ring_exit(void);
+static int ring_enter(unsigned to_submit, unsigned min_complete);
+static void ring_reap(void);
+static uint8_t slot_match(uint32_t blkno);
+static uint8_t slot_wait(DRIVE_SLOT *s);
+static uint8_t slot_take(uint32_t blkno, uint8_t *hdr, uint16_t hdr_len, uint8_t *data);
+static void slot_drop(uint32_t blkno);
+#endif
+
 static int drive_fd;
 
+#ifdef TFS_DRIVE_MAP_BLOCK
+// read only mapping of image files
+static uint8_t *drive_map;
+static size_t drive_map_len;
+
+static void drive_unmap(void);
+#endif
+
 int drive_open(const char *dev) {
   drive_fd = open(dev, O_RDWR);
   if (drive_fd < 0) {
     return -1;
   }
 
+#ifdef TFS_DRIVE_PREFETCH
+  // no io_uring -> prefetch is disabled, all requests are synchronous
+  if (ring_init() < 0) {
+    ring_exit();
+  }
+#endif
+
   return 0;
 }
 
 int drive_close(void) {
+#ifdef TFS_DRIVE_MAP_BLOCK
+  drive_unmap();
+#endif
+#ifdef TFS_DRIVE_PREFETCH
+  ring_exit();
+#endif
   return close(drive_fd);
 }
+
+void drive_sync(void) {
+  // pwrite only reaches the page cache, push it to the device
+  if (fdatasync(drive_fd) < 0) {
+    tfs_last_error = TFS_ERR_IO;
+  }
+}
+
+#ifdef TFS_DRIVE_PREFETCH
+static int ring_init(void) {
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  ring.fd = syscall(__NR_io_uring_setup, DRIVE_PREFETCH_SLOTS, &p);
+  if (ring.fd < 0) {
+    return -1;
+  }
+
+  // map submission and completion rings
+  ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring.cq_len > ring.sq_len) {
+      ring.sq_len = ring.cq_len;
+    }
+  }
+
+  ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (ring.sq_ptr == MAP_FAILED) {
+    ring.sq_ptr = NULL;
+    return -1;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring.cq_ptr = ring.sq_ptr;
+  } else {
+    ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cq_ptr == MAP_FAILED) {
+      ring.cq_ptr = NULL;
+      return -1;
+    }
+  }
+
+  ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) {
+    ring.sqes = NULL;
+    return -1;
+  }
+
+  ring.sq_tail = (unsigned *) ((uint8_t *) ring.sq_ptr + p.sq_off.tail);
+  ring.sq_mask = (unsigned *) ((uint8_t *) ring.sq_ptr + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *) ((uint8_t *) ring.sq_ptr + p.sq_off.array);
+  ring.cq_head = (unsigned *) ((uint8_t *) ring.cq_ptr + p.cq_off.head);
+  ring.cq_tail = (unsigned *) ((uint8_t *) ring.cq_ptr + p.cq_off.tail);
+  ring.cq_mask = (unsigned *) ((uint8_t *) ring.cq_ptr + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) ((uint8_t *) ring.cq_ptr + p.cq_off.cqes);
+
+  return 0;
+}
+
+static void ring_exit(void) {
+  DRIVE_SLOT *s;
+  int i;
+
+  // closing the ring waits for requests in flight
+  if (ring.fd >= 0) {
+    close(ring.fd);
+  }
+
+  if (ring.sqes != NULL) {
+    munmap(ring.sqes, ring.sqes_len);
+  }
+  if (ring.cq_ptr != NULL && ring.cq_ptr != ring.sq_ptr) {
+    munmap(ring.cq_ptr, ring.cq_len);
+  }
+  if (ring.sq_ptr != NULL) {
+    munmap(ring.sq_ptr, ring.sq_len);
+  }
+
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+
+  for (i = 0, s = slots; i < DRIVE_PREFETCH_SLOTS; i++, s++) {
+    s->state = SLOT_FREE;
+  }
+}
+
+static int ring_enter(unsigned to_submit, unsigned min_complete) {
+  int ret;
+
+  do {
+    ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+      min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  // ring is unusable -> fall back to synchronous requests
+  if (ret < 0 || ret < (int) to_submit) {
+    ring_exit();
+    return -1;
+  }
+
+  return 0;
+}
+
+static void ring_reap(void) {
+  unsigned head, tail;
+  struct io_uring_cqe *cqe;
+  DRIVE_SLOT *s;
+
+  head = *ring.cq_head;
+  tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    cqe = &ring.cqes[head & *ring.cq_mask];
+    s = &slots[cqe->user_data];
+    s->res = cqe->res;
+    s->state = SLOT_DONE;
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static uint8_t slot_wait(DRIVE_SLOT *s) {
+  while (s->state == SLOT_BUSY) {
+    ring_reap();
+    if (s->state != SLOT_BUSY) {
+      break;
+    }
+
+    if (ring_enter(0, 1) < 0) {
+      return 0;
+    }
+  }
+
+  return s->state == SLOT_DONE;
+}
+
+static uint8_t slot_match(uint32_t blkno) {
+  DRIVE_SLOT *s = &slots[blkno % DRIVE_PREFETCH_SLOTS];
+
+  return s->state != SLOT_FREE && s->blkno == blkno;
+}
+
+static uint8_t slot_take(uint32_t blkno, uint8_t *hdr, uint16_t hdr_len, uint8_t *data) {
+  DRIVE_SLOT *s = &slots[blkno % DRIVE_PREFETCH_SLOTS];
+
+  if (!slot_match(blkno)) {
+    return 0;
+  }
+
+  if (!slot_wait(s)) {
+    return 0;
+  }
+
+  // failed requests are repeated synchronously by the caller
+  s->state = SLOT_FREE;
+  if (s->res != TFS_BLOCKSIZE) {
+    return 0;
+  }
+
+  memcpy(hdr, s->data, hdr_len);
+  memcpy(data, s->data + hdr_len, TFS_BLOCKSIZE - hdr_len);
+  return 1;
+}
+
+static void slot_drop(uint32_t blkno) {
+  DRIVE_SLOT *s = &slots[blkno % DRIVE_PREFETCH_SLOTS];
+
+  if (!slot_match(blkno)) {
+    return;
+  }
+
+  // block gets overwritten, prefetched data is stale
+  slot_wait(s);
+  s->state = SLOT_FREE;
+}
+
+void drive_prefetch_blocks(uint32_t blkno, uint16_t count) {
+  DRIVE_SLOT *s;
+  struct io_uring_sqe *sqe;
+  unsigned tail, idx;
+  unsigned submit = 0;
+
+#ifdef TFS_DRIVE_MAP_BLOCK
+  // mapped image -> let the kernel read ahead the pages
+  if (drive_map != NULL) {
+    size_t start, end;
+
+    if (blkno >= tfs_drive_info.blk_count) {
+      return;
+    }
+    if (count > tfs_drive_info.blk_count - blkno) {
+      count = tfs_drive_info.blk_count - blkno;
+    }
+
+    start = ((size_t) blkno * TFS_BLOCKSIZE) & ~((size_t) getpagesize() - 1);
+    end = ((size_t) blkno + count) * TFS_BLOCKSIZE;
+    madvise(drive_map + start, end - start, MADV_WILLNEED);
+    return;
+  }
+#endif
+
+  if (ring.fd < 0) {
+    return;
+  }
+
+  if (count > DRIVE_PREFETCH_SLOTS) {
+    count = DRIVE_PREFETCH_SLOTS;
+  }
+
+  // collect completed requests to free their slots
+  ring_reap();
+
+  tail = *ring.sq_tail;
+  for (; count > 0 && blkno < tfs_drive_info.blk_count; count--, blkno++) {
+    s = &slots[blkno % DRIVE_PREFETCH_SLOTS];
+
+    // already requested?
+    if (slot_match(blkno)) {
+      continue;
+    }
+
+    // slot still in use by an other request
+    if (s->state == SLOT_BUSY) {
+      continue;
+    }
+
+    s->state = SLOT_BUSY;
+    s->blkno = blkno;
+    s->iov.iov_base = s->data;
+    s->iov.iov_len = TFS_BLOCKSIZE;
+
+    idx = tail & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = drive_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &s->iov;
+    sqe->len = 1;
+    sqe->off = (uint64_t) blkno * TFS_BLOCKSIZE;
+    sqe->user_data = s - slots;
+    ring.sq_array[idx] = idx;
+    tail++;
+    submit++;
+  }
+
+  if (submit == 0) {
+    return;
+  }
+
+  __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+  ring_enter(submit, 0);
+}
+#endif
+#ifdef TFS_DRIVE_MAP_BLOCK
+static void drive_unmap(void) {
+  if (drive_map != NULL) {
+    munmap(drive_map, drive_map_len);
+    drive_map = NULL;
+  }
+}
+
+const uint8_t *drive_map_block(uint32_t blkno) {
+  if (drive_map == NULL || blkno >= tfs_drive_info.blk_count) {
+    return NULL;
+  }
+
+  return drive_map + (size_t) blkno * TFS_BLOCKSIZE;
+}
+#endif
+
 void drive_init(void) {
   struct stat st;
 
   memset(&tfs_drive_info, 0, sizeof(TFS_DRIVE_INFO));
+#ifdef TFS_DRIVE_MAP_BLOCK
+  drive_unmap();
+#endif
 
   if (fstat(drive_fd, &st) < 0) {
     tfs_last_error = TFS_ERR_NO_DEV;
@@ -39,6 +384,18 @@ void drive_init(void) {
     strcpy(tfs_drive_info.serno, "N/A");
     tfs_drive_info.blk_count = st.st_size / TFS_BLOCKSIZE;
     tfs_last_error = TFS_ERR_OK;
+
+#ifdef TFS_DRIVE_MAP_BLOCK
+    // map image for zero copy access, writes still use pwrite
+    // (shared mapping and page cache stay coherent)
+    drive_map_len = (size_t) tfs_drive_info.blk_count * TFS_BLOCKSIZE;
+    if (drive_map_len > 0) {
+      drive_map = mmap(NULL, drive_map_len, PROT_READ, MAP_SHARED, drive_fd, 0);
+      if (drive_map == MAP_FAILED) {
+        drive_map = NULL;
+      }
+    }
+#endif
     return;
   }
 
@@ -65,12 +422,14 @@ void drive_read_block(uint32_t blkno, uint8_t *data) {
     return;
   }
 
-  if (lseek(drive_fd, (off_t) blkno * TFS_BLOCKSIZE, SEEK_SET) < 0) {
-    tfs_last_error = TFS_ERR_IO;
+#ifdef TFS_DRIVE_PREFETCH
+  // complete a prefetched request
+  if (slot_take(blkno, data, 0, data)) {
     return;
   }
+#endif
 
-  if (read(drive_fd, data, TFS_BLOCKSIZE) < 0) {
+  if (pread(drive_fd, data, TFS_BLOCKSIZE, (off_t) blkno * TFS_BLOCKSIZE) != TFS_BLOCKSIZE) {
     tfs_last_error = TFS_ERR_IO;
     return;
   }
@@ -82,15 +441,116 @@ void drive_write_block(uint32_t blkno, const uint8_t *data) {
     return;
   }
 
-  if (lseek(drive_fd, (off_t) blkno * TFS_BLOCKSIZE, SEEK_SET) < 0) {
+#ifdef TFS_DRIVE_PREFETCH
+  slot_drop(blkno);
+#endif
+
+  if (pwrite(drive_fd, data, TFS_BLOCKSIZE, (off_t) blkno * TFS_BLOCKSIZE) != TFS_BLOCKSIZE) {
     tfs_last_error = TFS_ERR_IO;
     return;
   }
+}
+
+// blocks per preadv/pwritev call, every block needs a header and a data iovec
+// (keeps the vector well below the kernel limit of 1024 entries)
+#define DRIVE_IOV_BLOCKS 128
+
+static void read_blocks_sync(uint32_t blkno, uint16_t count, uint8_t *hdr, uint16_t hdr_len, uint8_t *data) {
+  struct iovec iov[DRIVE_IOV_BLOCKS * 2];
+  uint16_t data_len = TFS_BLOCKSIZE - hdr_len;
+  int i, n;
+
+  while (count > 0) {
+    n = count > DRIVE_IOV_BLOCKS ? DRIVE_IOV_BLOCKS : count;
+    for (i = 0; i < n; i++, hdr += hdr_len, data += data_len) {
+      iov[2 * i].iov_base = hdr;
+      iov[2 * i].iov_len = hdr_len;
+      iov[2 * i + 1].iov_base = data;
+      iov[2 * i + 1].iov_len = data_len;
+    }
+
+    if (preadv(drive_fd, iov, 2 * n, (off_t) blkno * TFS_BLOCKSIZE) != (ssize_t) n * TFS_BLOCKSIZE) {
+      tfs_last_error = TFS_ERR_IO;
+      return;
+    }
+
+    blkno += n;
+    count -= n;
+  }
+}
+
+void drive_read_blocks(uint32_t blkno, uint16_t count, uint8_t *hdr, uint16_t hdr_len, uint8_t *data) {
+#ifdef TFS_DRIVE_PREFETCH
+  uint16_t data_len = TFS_BLOCKSIZE - hdr_len;
+  uint16_t n;
+#endif
 
-  if (write(drive_fd, data, TFS_BLOCKSIZE) < 0) {
+  if (blkno >= tfs_drive_info.blk_count || count > tfs_drive_info.blk_count - blkno) {
     tfs_last_error = TFS_ERR_IO;
     return;
   }
+
+#ifdef TFS_DRIVE_PREFETCH
+  while (count > 0) {
+    // complete prefetched requests
+    if (slot_take(blkno, hdr, hdr_len, data)) {
+      blkno++;
+      count--;
+      hdr += hdr_len;
+      data += data_len;
+      continue;
+    }
+
+    // read blocks up to the next prefetched one in a single request
+    for (n = 1; n < count && !slot_match(blkno + n); n++);
+    read_blocks_sync(blkno, n, hdr, hdr_len, data);
+    if (tfs_last_error != TFS_ERR_OK) {
+      return;
+    }
+
+    blkno += n;
+    count -= n;
+    hdr += (uint32_t) n * hdr_len;
+    data += (uint32_t) n * data_len;
+  }
+#else
+  read_blocks_sync(blkno, count, hdr, hdr_len, data);
+#endif
+}
+
+void drive_write_blocks(uint32_t blkno, uint16_t count, const uint8_t *hdr, uint16_t hdr_len, const uint8_t *data) {
+  struct iovec iov[DRIVE_IOV_BLOCKS * 2];
+  uint16_t data_len = TFS_BLOCKSIZE - hdr_len;
+  int i, n;
+
+  if (blkno >= tfs_drive_info.blk_count || count > tfs_drive_info.blk_count - blkno) {
+    tfs_last_error = TFS_ERR_IO;
+    return;
+  }
+
+#ifdef TFS_DRIVE_PREFETCH
+  for (i = 0; i < count; i++) {
+    slot_drop(blkno + i);
+  }
+#endif
+
+  while (count > 0) {
+    n = count > DRIVE_IOV_BLOCKS ? DRIVE_IOV_BLOCKS : count;
+    for (i = 0; i < n; i++, hdr += hdr_len, data += data_len) {
+      iov[2 * i].iov_base = (void *) hdr;
+      iov[2 * i].iov_len = hdr_len;
+      iov[2 * i + 1].iov_base = (void *) data;
+      iov[2 * i + 1].iov_len = data_len;
+    }
+
+    if (pwritev(drive_fd, iov, 2 * n, (off_t) blkno * TFS_BLOCKSIZE) != (ssize_t) n * TFS_BLOCKSIZE) {
+      tfs_last_error = TFS_ERR_IO;
+      return;
+    }
+
+    blkno += n;
+    count -= n;
+  }
 }
 
 void drive_select(void) {
@@ -5,5 +5,6 @@
 
 int drive_open(const char *dev);
 int drive_close(void);
+void drive_sync(void);
 
 #endif
@@ -21,6 +21,7 @@ static const ERROR_ITEM errors[] = {
   { .val = TFS_ERR_NO_NAME, .msg = "No filename given.", .error = EINVAL },
   { .val = TFS_ERR_NAME_INVAL, .msg = "Invalid filename.", .error = EINVAL },
   { .val = TFS_ERR_UNEXP_EOF, .msg = "Unexpected end of file.", .error = ESPIPE },
+  { .val = TFS_ERR_FEATURE, .msg = "Unsupported volume format.", .error = EOPNOTSUPP },
   { .val = TFS_ERR_NO_FREE_FD, .msg = "No free FD available.", .error = EMFILE },
   { .val = TFS_ERR_INVAL_FD, .msg = "Invalid file handle.", .error = EBADF },
   { .val = TFS_FILE_BUSY, .msg = "File is busy.", .error = ETXTBSY },
@@ -8,6 +8,22 @@
 #define TFS_EXTENDED_API
 #define TFS_MAX_FDS 32
 
+#define TFS_DRIVE_MULTI_BLOCK
+#define TFS_MULTI_BLOCK_MAX 128
+#define TFS_DRIVE_PREFETCH
+#define TFS_DRIVE_MAP_BLOCK
+
+#define TFS_CACHE_BLOCKS 256
+#define TFS_CACHE_WAYS 4
+
+#define TFS_BITMAP_WORD_SCAN
+#define TFS_BITMAP_SUMMARY 65536
+#define TFS_FREE_EXTENTS 262144
+#define TFS_BITMAP_RESIDENT 65536
+#define TFS_RECLAIM_STEP 256
+#define TFS_EXTENT_FILES
+#define TFS_SEEK_INDEX 64
+
 typedef struct {
   void *buffer;
   fuse_fill_dir_t filler;
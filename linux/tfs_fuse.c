@@ -10,6 +10,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <linux/falloc.h>
 
 #include "filesys.h"
 #include "drive.h"
@@ -61,12 +62,12 @@ static const char *travel_path(const char *path) {
 }
 
 static int item_to_stat(const TFS_DIR_ITEM *item, struct stat *st) {
-  if (item->type == TFS_DIR_ITEM_DIR) {
+  if (TFS_DIR_ITEM_TYPE(item->type) == TFS_DIR_ITEM_DIR) {
     st->st_mode = S_IFDIR | 0755;
     return 0;
   }
 
-  if (item->type == TFS_DIR_ITEM_FILE) {
+  if (TFS_DIR_ITEM_TYPE(item->type) == TFS_DIR_ITEM_FILE) {
     st->st_mode = S_IFREG | 0755;
     st->st_size = item->size;
     return 0;
@@ -335,6 +336,40 @@ static int op_ftruncate(const char *path, off_t newsize, struct fuse_file_info *
   return check_error("op_ftruncate:tfs_trunc");
 }
 
+static int op_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+  int err;
+  struct stat st;
+
+  // only plain preallocation is supported, with or without size change
+  // (no punch hole, collapse or zero range)
+  if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE) {
+    return -EOPNOTSUPP;
+  }
+
+  // file sizes are 32 bit, the range must not be cut
+  if (offset + len > UINT32_MAX) {
+    return -EFBIG;
+  }
+
+  tfs_fallocate(fi->fh, offset + len);
+  err = check_error("op_fallocate:tfs_fallocate");
+  if (err || mode == FALLOC_FL_KEEP_SIZE) {
+    return err;
+  }
+
+  // posix_fallocate grows the file, but never shrinks it
+  err = op_getattr(path, &st);
+  if (err) {
+    return err;
+  }
+  if (offset + len > st.st_size) {
+    tfs_trunc(fi->fh, offset + len);
+    return check_error("op_fallocate:tfs_trunc");
+  }
+
+  return 0;
+}
+
 static int op_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
   int err;
   int len;
@@ -366,6 +401,19 @@ static int op_release(const char *path, struct fuse_file_info *fi) {
   return check_error("op_release:tfs_close");
 }
 
+static int op_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  int err;
+
+  tfs_flush();
+  err = check_error("op_fsync:tfs_flush");
+  if (err) {
+    return err;
+  }
+
+  drive_sync();
+  return check_error("op_fsync:drive_sync");
+}
+
 static const struct fuse_operations ops = {
   .getattr = op_getattr,
   .mknod = op_mknod,
@@ -375,11 +423,13 @@ static const struct fuse_operations ops = {
   .rename = op_rename,
   .truncate = op_truncate,
   .ftruncate = op_ftruncate,
+  .fallocate = op_fallocate,
   .open = op_open,
   .read = op_read,
   .write = op_write,
   .statfs = op_statfs,
   .release = op_release,
+  .fsync = op_fsync,
   .readdir = op_readdir
 };
 
@@ -444,6 +494,16 @@ int main(int argc, char **argv) {
   // turn over control to fuse
   ret = fuse_main_st(argc, argv, &ops, sizeof(ops), NULL);
 
+  // write back cached blocks
+  tfs_flush();
+  if (tfs_last_error == TFS_ERR_OK) {
+    drive_sync();
+  }
+  if (tfs_last_error != TFS_ERR_OK) {
+    fprintf(stderr, "Failed to flush tfs.\n");
+    ret = 1;
+  }
+
   drive_close();
 
   return ret;
@@ -35,6 +35,9 @@
 // CMD18: arg0[31:0]: data address, response R1
 #define CMD_READ_MULTIPLE_BLOCK 0x12
 
+// ACMD23: arg0[22:0]: number of blocks, response R1
+#define CMD_SET_WR_BLK_ERASE_COUNT 0x17
+
 // CMD24: arg0[31:0]: data address, response R1
 #define CMD_WRITE_SINGLE_BLOCK 0x18
 
@@ -99,6 +102,15 @@
 #define STATE_ADDR_ERR      (1 << 5)
 #define STATE_PARAM_ERR     (1 << 6)
 
+// data tokens
+#define TOKEN_START_BLOCK       0xfe
+#define TOKEN_START_MULTI_WRITE 0xfc
+#define TOKEN_STOP_TRAN         0xfd
+
+// data response token: xxx0sss1, sss = 010: data accepted
+#define DATA_RESP_MASK     0x1f
+#define DATA_RESP_ACCEPTED 0x05
+
 #define TIMEOUT 0x7fff
 
 // private helper functions
@@ -106,9 +118,24 @@ static char hex_char(uint8_t val);
 static uint8_t wait_byte(uint8_t val);
 static uint8_t send_command(uint8_t command, uint32_t arg);
 static uint8_t get_info(void);
+static uint8_t start_read(uint32_t blkno);
+#ifdef TFS_DRIVE_MULTI_BLOCK
+static uint8_t stop_read(void);
+static uint8_t stop_write(void);
+#endif
 
 static uint8_t tmp_buf[18];
 
+#ifdef TFS_MMC_DEFER_BUSY
+// card is programming the last written block
+static uint8_t card_busy;
+#endif
+
+#ifdef TFS_DRIVE_STREAM
+// bytes of the streamed block (including crc16) not yet transferred
+static uint16_t stream_rem;
+#endif
+
 void drive_init(void) {
   uint8_t resp;
   uint16_t i;
@@ -255,6 +282,16 @@ static uint8_t send_command(uint8_t command, uint32_t arg) {
   // wait some clock cycles
   spi_rec_byte();
 
+#ifdef TFS_MMC_DEFER_BUSY
+  // wait until the card has finished the previous write
+  if (card_busy) {
+    if (!wait_byte(0xff)) {
+      return 0xff;
+    }
+    card_busy = 0;
+  }
+#endif
+
   // send command via SPI
   spi_send_byte(0x40 | command);
   spi_send_byte(arg >> 24);
@@ -273,6 +310,11 @@ static uint8_t send_command(uint8_t command, uint32_t arg) {
       spi_send_byte(0xff);
       break;
   }
+
+  // skip stuff byte following the stop command
+  if (command == CMD_STOP_TRANSMISSION) {
+    spi_rec_byte();
+  }
     
   // receive response
   for (resp = 0xff, i = 0; resp == 0xff && i < 10; i++) {
@@ -282,7 +324,7 @@ static uint8_t send_command(uint8_t command, uint32_t arg) {
   return resp;
 }
 
-void drive_read_block(uint32_t blkno, uint8_t *data) {
+static uint8_t start_read(uint32_t blkno) {
   // use byte offset if not SDHC
   if (tfs_drive_info.type != DRIVE_TYPE_SDHC) {
     blkno <<= TFS_BLOCKSIZE_WIDTH;
@@ -290,12 +332,15 @@ void drive_read_block(uint32_t blkno, uint8_t *data) {
 
   // send single block request
   if (send_command(CMD_READ_SINGLE_BLOCK, blkno)) {
-    tfs_last_error = TFS_ERR_IO;
-    return;
+    return 0;
   }
 
   // wait for data block (start byte 0xfe)
-  if (!wait_byte(0xfe)) {
+  return wait_byte(TOKEN_START_BLOCK);
+}
+
+void drive_read_block(uint32_t blkno, uint8_t *data) {
+  if (!start_read(blkno)) {
     tfs_last_error = TFS_ERR_IO;
     return;
   }
@@ -307,6 +352,34 @@ void drive_read_block(uint32_t blkno, uint8_t *data) {
   spi_read_block(tmp_buf, 2);
 }
 
+#ifdef TFS_DRIVE_STREAM
+void drive_stream_open(uint32_t blkno) {
+  stream_rem = 0;
+  if (!start_read(blkno)) {
+    tfs_last_error = TFS_ERR_IO;
+    return;
+  }
+
+  stream_rem = TFS_BLOCKSIZE + 2;
+}
+
+void drive_stream_read(uint8_t *data, uint16_t len) {
+  spi_read_block(data, len);
+  stream_rem -= len;
+}
+
+void drive_stream_skip(uint16_t len) {
+  spi_dummy_transfer(len);
+  stream_rem -= len;
+}
+
+void drive_stream_close(void) {
+  // clock out the rest of the block and the crc16
+  spi_dummy_transfer(stream_rem);
+  stream_rem = 0;
+}
+#endif
+
 void drive_write_block(uint32_t blkno, const uint8_t *data) {
   // use byte offset if not SDHC
   if (tfs_drive_info.type != DRIVE_TYPE_SDHC) {
@@ -332,12 +405,139 @@ void drive_write_block(uint32_t blkno, const uint8_t *data) {
   spi_send_byte(0xff);
   spi_send_byte(0xff);
 
+#ifdef TFS_MMC_DEFER_BUSY
+  // check data response, the card is busy afterwards in any case
+  card_busy = 1;
+  if ((spi_rec_byte() & DATA_RESP_MASK) != DATA_RESP_ACCEPTED) {
+    tfs_last_error = TFS_ERR_IO;
+  }
+
+  // return while the card programs the block,
+  // the next command waits for the busy state to end
+#else
   // wait while card is busy
   if (!wait_byte(0xff)) {
     tfs_last_error = TFS_ERR_IO;
     return;
   }
+#endif
+}
+
+#ifdef TFS_DRIVE_MULTI_BLOCK
+void drive_read_blocks(uint32_t blkno, uint16_t count, uint8_t *hdr, uint16_t hdr_len, uint8_t *data) {
+  uint16_t data_len = TFS_BLOCKSIZE - hdr_len;
+
+  // use byte offset if not SDHC
+  if (tfs_drive_info.type != DRIVE_TYPE_SDHC) {
+    blkno <<= TFS_BLOCKSIZE_WIDTH;
+  }
+
+  // send multiple block request, card streams consecutive blocks until stopped
+  if (send_command(CMD_READ_MULTIPLE_BLOCK, blkno)) {
+    tfs_last_error = TFS_ERR_IO;
+    return;
+  }
+
+  for (; count > 0; count--, hdr += hdr_len, data += data_len) {
+    // wait for data block (start byte 0xfe)
+    if (!wait_byte(TOKEN_START_BLOCK)) {
+      stop_read();
+      tfs_last_error = TFS_ERR_IO;
+      return;
+    }
+
+    // read header and data part of the block
+    spi_read_block(hdr, hdr_len);
+    spi_read_block(data, data_len);
+
+    // read crc16
+    spi_read_block(tmp_buf, 2);
+  }
+
+  if (!stop_read()) {
+    tfs_last_error = TFS_ERR_IO;
+  }
+}
+
+void drive_write_blocks(uint32_t blkno, uint16_t count, const uint8_t *hdr, uint16_t hdr_len, const uint8_t *data) {
+  uint16_t data_len = TFS_BLOCKSIZE - hdr_len;
+
+  // SD cards may pre-erase the blocks of the run (ACMD23),
+  // a failure only loses the hint
+  if (tfs_drive_info.type != DRIVE_TYPE_MMC) {
+    send_command(CMD_APP, 0);
+    send_command(CMD_SET_WR_BLK_ERASE_COUNT, count);
+  }
+
+  // use byte offset if not SDHC
+  if (tfs_drive_info.type != DRIVE_TYPE_SDHC) {
+    blkno <<= TFS_BLOCKSIZE_WIDTH;
+  }
+
+  // send multiple block request
+  if (send_command(CMD_WRITE_MULTIPLE_BLOCK, blkno)) {
+    tfs_last_error = TFS_ERR_IO;
+    return;
+  }
+
+  // 8 dummy cycles if the command is a write command
+  spi_rec_byte();
+
+  for (; count > 0; count--, hdr += hdr_len, data += data_len) {
+    // send start byte
+    spi_send_byte(TOKEN_START_MULTI_WRITE);
+
+    // write header and data part of the block
+    spi_write_block(hdr, hdr_len);
+    spi_write_block(data, data_len);
+
+    // write dummy crc16
+    spi_send_byte(0xff);
+    spi_send_byte(0xff);
+
+    // check data response
+    if ((spi_rec_byte() & DATA_RESP_MASK) != DATA_RESP_ACCEPTED) {
+      stop_write();
+      tfs_last_error = TFS_ERR_IO;
+      return;
+    }
+
+    // wait while card is busy
+    if (!wait_byte(0xff)) {
+      stop_write();
+      tfs_last_error = TFS_ERR_IO;
+      return;
+    }
+  }
+
+  if (!stop_write()) {
+    tfs_last_error = TFS_ERR_IO;
+  }
+}
+
+static uint8_t stop_read(void) {
+  // stop transmission, card is busy afterwards
+  if (send_command(CMD_STOP_TRANSMISSION, 0)) {
+    return 0;
+  }
+
+  return wait_byte(0xff);
+}
+
+static uint8_t stop_write(void) {
+  // send stop token, skip one byte before the card signals busy
+  spi_send_byte(TOKEN_STOP_TRAN);
+  spi_rec_byte();
+
+#ifdef TFS_MMC_DEFER_BUSY
+  // the next command waits for the last block to be programmed
+  card_busy = 1;
+  return 1;
+#else
+  return wait_byte(0xff);
+#endif
 }
+#endif
 
 static uint8_t get_info(void) {
   uint8_t manuf;
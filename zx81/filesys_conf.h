@@ -4,6 +4,10 @@
 #undef TFS_EXTENDED_API
 #undef TFS_READ_DIR_USERDATA
 
+#define TFS_DRIVE_STREAM
+
+#define TFS_MMC_DEFER_BUSY
+
 #define TFS_FILENAME_CMP(ref, cmp) filename_cmp(ref, cmp)
 uint8_t filename_cmp(const char *ref, const char *cmp);
 
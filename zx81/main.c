@@ -171,7 +171,7 @@ static void print_dir_header(void) {
 uint8_t tfs_dir_handler(const TFS_DIR_ITEM *item) {
   uint16_t key;
 
-  switch (item->type) {
+  switch (TFS_DIR_ITEM_TYPE(item->type)) {
     case TFS_DIR_ITEM_DIR:
       dir_dirs++;
       term_puts("     <DIR>");